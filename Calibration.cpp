@@ -0,0 +1,130 @@
+/*
+ * Calibration.cpp
+ *
+ * Runs before interrupts are enabled, so all of the timing here is done
+ * with busy waits. One output takes about a second: 15 measurements of
+ * CAL_SETTLE_MS + CAL_SAMPLES conversions (104 us each at F_CPU/128).
+ */ 
+
+#include <avr/io.h>
+#include <math.h>
+#include <util/delay.h>
+
+#include "GPIO.h"
+#include "Calibration.h"
+
+#define CAL_SETTLE_MS		20		// let the output op-amp settle after each DAC write
+#define CAL_SAMPLES			256		// ADC readings averaged per measurement
+#define CAL_MV_PER_OCTAVE	1000.0
+#define CAL_MAX_ERROR		0.05	// reject calibration values >5% away from DAC_CAL_VALUE
+#define CAL_CODE_MAX		0x0FFF
+
+#define CAL_ADC_FULL_SCALE_MV (CAL_ADC_REF_MV * CAL_ADC_DIVIDER)
+
+static void adc_begin(uint8_t channel)
+{
+	ADMUX = (1 << REFS0) | (channel & 0x0F);	// AVcc reference, right adjusted result
+	ADCSRA = (1 << ADEN) | (1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0); // F_CPU/128 = 125 kHz
+	
+	// the first conversion after enabling the ADC is slower and less accurate: discard it
+	ADCSRA |= (1 << ADSC);
+	while (ADCSRA & (1 << ADSC));
+}
+
+static void adc_end()
+{
+	ADCSRA = 0;
+}
+
+/*
+	measure_mv - writes CODE to the DAC and returns the voltage on the V/oct output in mV
+*/
+static float measure_mv(uint8_t dac_ch, uint16_t code)
+{
+	CvOutput::output_dac(dac_ch, code);
+	_delay_ms(CAL_SETTLE_MS);
+	
+	uint32_t sum = 0;
+	for (uint16_t i = 0; i < CAL_SAMPLES; i++)
+	{
+		ADCSRA |= (1 << ADSC);
+		while (ADCSRA & (1 << ADSC));
+		sum += ADC;
+	}
+	
+	return sum * (CAL_ADC_FULL_SCALE_MV / 1024.0 / CAL_SAMPLES);
+}
+
+/*
+	calibrate_output - measures the V/oct output of CV through ADC_CHANNEL and
+		writes one calibration point per octave into its settings. The settings
+		are left untouched if the measurements don't make sense (nothing patched
+		into the ADC, divider too small, ...).
+*/
+bool calibrate_output(CvOutput& cv, uint8_t adc_channel)
+{
+	uint16_t codes[NUM_CAL_POINTS];
+	float mv[NUM_CAL_POINTS];
+	float cal[NUM_CAL_POINTS];
+	bool ok = true;
+	
+	adc_begin(adc_channel);
+	
+	/* sweep: measure the output at the nominal DAC code of each C */
+	for (uint8_t k = 0; k < NUM_CAL_POINTS && ok; k++)
+	{
+		codes[k] = 12 * k * DAC_CAL_VALUE + 0.5;
+		mv[k] = measure_mv(cv.dac_ch, codes[k]);
+		
+		// a reading close to full scale means the ADC is clipping
+		ok = mv[k] < CAL_ADC_FULL_SCALE_MV * 0.98;
+	}
+	
+	/* fit: find the DAC code that is exactly 1V/oct above the output at code 0 */
+	for (uint8_t oct = 1; oct < NUM_CAL_POINTS && ok; oct++)
+	{
+		float target = mv[0] + oct * CAL_MV_PER_OCTAVE;
+		
+		// the segment between two measured points that contains the target,
+		// the first and last segments are extrapolated if needed
+		uint8_t k = 0;
+		while (k < NUM_CAL_POINTS - 2 && mv[k + 1] < target)
+		{
+			k++;
+		}
+		
+		float slope = (mv[k + 1] - mv[k]) / (codes[k + 1] - codes[k]); // mV per DAC code
+		if (slope <= 0)
+		{
+			ok = false;
+			break;
+		}
+		
+		float code = codes[k] + (target - mv[k]) / slope;
+		
+		// one more measurement at the fitted code corrects for the curvature inside the segment
+		float measured = measure_mv(cv.dac_ch, in_range(code + 0.5, 0, CAL_CODE_MAX));
+		code += (target - measured) / slope;
+		
+		cal[oct] = code / (12 * oct);
+		ok = fabs(cal[oct] - DAC_CAL_VALUE) < DAC_CAL_VALUE * CAL_MAX_ERROR;
+	}
+	
+	adc_end();
+	CvOutput::output_dac(cv.dac_ch, 0);
+	
+	if (!ok)
+	{
+		return false;
+	}
+	
+	// midi_to_data scales the note number by the calibration value, so the
+	// lowest C (note 0 after the offset) has no point of its own
+	cal[0] = cal[1];
+	for (uint8_t i = 0; i < NUM_CAL_POINTS; i++)
+	{
+		cv.settings.calibration_points[i] = cal[i];
+	}
+	
+	return true;
+}
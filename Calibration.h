@@ -0,0 +1,17 @@
+/*
+ * Calibration.h
+ *
+ * Automatic V/oct calibration. The DAC is swept over one point per octave,
+ * the V/oct output is read back through the ADC and a slope/offset is
+ * fitted per octave to find the DAC code that lands exactly on each volt.
+ */ 
+
+
+#ifndef CALIBRATION_H_
+#define CALIBRATION_H_
+
+#include "CvOutput.h"
+
+bool calibrate_output(CvOutput& cv, uint8_t adc_channel);
+
+#endif /* CALIBRATION_H_ */
@@ -10,33 +10,54 @@ class CircularBuffer
 {
 public:
 	T buffer[SIZE];
-    uint8_t write_idx;
-    uint8_t read_idx;
+    volatile uint8_t write_idx;  /* volatile: buffers are shared with ISRs */
+    volatile uint8_t read_idx;
+    
+    /* for sizing the buffers: most items ever queued at once, and items lost
+       to a full buffer (the oldest in OVERWRITE_MODE, else the new one) */
+    uint8_t peak;
+    uint16_t drops;
 
 public:
 	CircularBuffer();
 
     bool put(T item);
     bool get(T* val_ptr);
+    bool peek(T* val_ptr) const;
     uint8_t ready() const;
+    uint8_t space() const;
+    bool full() const;
+    void count_drop() { if (drops < UINT16_MAX) drops++; }
+    void clear_stats();
 };
 
 template <typename T, uint8_t SIZE>
-CircularBuffer<T, SIZE>::CircularBuffer() : write_idx(0), read_idx(0) { }
+CircularBuffer<T, SIZE>::CircularBuffer() : write_idx(0), read_idx(0), peak(0), drops(0) { }
 
 template <typename T, uint8_t SIZE>
 bool CircularBuffer<T, SIZE>::put(T item)
 {
-#ifndef OVERWRITE_MODE
-	if ((write_idx + 1) % SIZE == read_idx)
+	if (full())
 	{
+		count_drop();
+		
+#ifdef OVERWRITE_MODE
+		// make room by dropping the oldest item
+		read_idx = (read_idx + 1) % SIZE;
+#else
 		// buffer is full, avoid overflow
 		return 0;
-	}
 #endif
+	}
 	
 	buffer[write_idx] = item;
 	write_idx = (write_idx + 1) % SIZE;
+	
+	uint8_t count = ready();
+	if (count > peak)
+	{
+		peak = count;
+	}
 	return 1;
 }
 
@@ -53,11 +74,43 @@ bool CircularBuffer<T, SIZE>::get(T* val_ptr)
 	return 1;
 }
 
+template <typename T, uint8_t SIZE>
+bool CircularBuffer<T, SIZE>::peek(T* val_ptr) const
+{
+	if (read_idx == write_idx)
+	{
+		return 0; // buffer is empty
+	}
+	
+	*val_ptr = buffer[read_idx];
+	return 1;
+}
+
 template <typename T, uint8_t SIZE>
 uint8_t CircularBuffer<T, SIZE>::ready() const
 {
-	return write_idx - read_idx;
+	uint8_t w = write_idx;
+	uint8_t r = read_idx;
+	return w >= r ? w - r : w + SIZE - r;
 }
 
+template <typename T, uint8_t SIZE>
+uint8_t CircularBuffer<T, SIZE>::space() const
+{
+	return SIZE - 1 - ready(); // one slot always stays empty
+}
+
+template <typename T, uint8_t SIZE>
+bool CircularBuffer<T, SIZE>::full() const
+{
+	return (write_idx + 1) % SIZE == read_idx;
+}
+
+template <typename T, uint8_t SIZE>
+void CircularBuffer<T, SIZE>::clear_stats()
+{
+	peak = 0;
+	drops = 0;
+}
 
 #endif // CIRCULAR_BUFFER_H
\ No newline at end of file
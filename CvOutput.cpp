@@ -7,11 +7,14 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
 #include <util/atomic.h>
 
 #include "CvOutput.h"
 #include "GPIO.h"
 #include "MidiController.h"
+#include "Trace.h"
 
 #define DAC_MIN 0x00
 #define DAC_MAX 0x0FFF
@@ -23,9 +26,13 @@
 #define spi_wait()	while (!(SPI_SPSR & (1 << SPI_SPIF)));
 
 #define MAX_SLIDE_LENGTH 2000.0 // 500 ms?
+#define OCTAVE_CODE ((int32_t) (12 * DAC_CAL_VALUE)) // one octave of DAC code
+#define OCTAVE_CODE_FIXED ((int32_t) (12 * DAC_CAL_VALUE * 65536)) // 16.16
 #define MAX_TRIG_LENGTH 50.0 // millis?
 #define PITCH_BEND_MAX 12.0 // semitones
 
+#define VEL_SLEW_MAX 1000UL // ms for a full scale VEL change
+
 #define VIB_DELAY_MAX 3000.0 // ms
 #define VIB_DEPTH_MAX 800.0  // cents
 #define VIB_FREQ_MIN 0.2 // Hz --> 5000 ms period
@@ -44,6 +51,69 @@ const float tempo_sync_divisions[8] = {
 	0.125, // 32nd
 };
 
+/* glide curves sampled at GLIDE_CURVE_POINTS evenly spaced points of the slide, 0 -> 0xFFFF.
+	Linear needs no table, so the first table is GlideExponential */
+#define GLIDE_CURVE_POINTS 33
+#define GLIDE_CURVE_SEGMENT_BITS 11 // 16-bit progress / 32 segments
+
+const uint16_t glide_curves[][GLIDE_CURVE_POINTS] PROGMEM = {
+	{	// GlideExponential: RC-style, (1 - e^(-5t)) / (1 - e^-5)
+	0, 9544, 17708, 24691, 30663, 35772, 40142, 43879, 47076, 49811, 52149,
+	54150, 55861, 57325, 58577, 59648, 60564, 61347, 62017, 62590, 63081, 63500,
+	63859, 64165, 64428, 64652, 64844, 65009, 65149, 65269, 65372, 65460, 65535
+	},
+	{	// GlideSCurve: smoothstep, 3t^2 - 2t^3
+	0, 188, 736, 1620, 2816, 4300, 6048, 8036, 10240, 12636, 15200,
+	17908, 20736, 23660, 26656, 29700, 32768, 35835, 38879, 41875, 44799, 47627,
+	50335, 52899, 55295, 57499, 59487, 61235, 62719, 63915, 64799, 65347, 65535
+	},
+	{	// GlideLogarithmic: the exponential one turned around, (e^(5t) - 1) / (e^5 - 1):
+		// leaves slowly and lands fast
+	0, 75, 163, 266, 386, 526, 691, 883, 1107, 1370, 1676,
+	2035, 2454, 2945, 3518, 4188, 4971, 5887, 6958, 8210, 9674, 11385,
+	13386, 15724, 18459, 21656, 25393, 29763, 34872, 40844, 47827, 55991, 65535
+	},
+};
+
+/* VEL output duty for every velocity. VelFixed needs no table and VelInverted
+	reads the linear one backwards */
+const uint8_t velocity_curves[][128] PROGMEM = {
+	{	// VelLinear: the same as velocity * 0xFF / 0x7F
+	0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30,
+	32, 34, 36, 38, 40, 42, 44, 46, 48, 50, 52, 54, 56, 58, 60, 62,
+	64, 66, 68, 70, 72, 74, 76, 78, 80, 82, 84, 86, 88, 90, 92, 94,
+	96, 98, 100, 102, 104, 106, 108, 110, 112, 114, 116, 118, 120, 122, 124, 126,
+	128, 130, 132, 134, 136, 138, 140, 142, 144, 146, 148, 150, 152, 154, 156, 158,
+	160, 162, 164, 166, 168, 170, 172, 174, 176, 178, 180, 182, 184, 186, 188, 190,
+	192, 194, 196, 198, 200, 202, 204, 206, 208, 210, 212, 214, 216, 218, 220, 222,
+	224, 226, 228, 230, 232, 234, 236, 238, 240, 242, 244, 246, 248, 250, 252, 255
+	},
+	{	// VelExponential: (e^(4v) - 1) / (e^4 - 1)
+	0, 0, 0, 0, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 3, 3,
+	3, 3, 4, 4, 4, 4, 5, 5, 5, 6, 6, 6, 7, 7, 7, 8,
+	8, 9, 9, 10, 10, 11, 11, 11, 12, 13, 13, 14, 14, 15, 16, 16,
+	17, 18, 18, 19, 20, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30,
+	31, 32, 33, 34, 36, 37, 38, 40, 41, 43, 44, 46, 47, 49, 51, 53,
+	54, 56, 58, 60, 62, 64, 67, 69, 71, 74, 76, 79, 82, 84, 87, 90,
+	93, 96, 99, 103, 106, 110, 113, 117, 121, 125, 129, 134, 138, 143, 147, 152,
+	157, 162, 168, 173, 179, 185, 191, 197, 204, 210, 217, 224, 232, 239, 247, 255
+	},
+	{	// VelLogarithmic: ln(1 + 15v) / ln 16
+	0, 10, 20, 28, 36, 43, 49, 55, 61, 67, 72, 77, 81, 86, 90, 94,
+	98, 101, 105, 108, 112, 115, 118, 121, 124, 126, 129, 132, 134, 137, 139, 142,
+	144, 146, 148, 150, 153, 155, 157, 159, 160, 162, 164, 166, 168, 169, 171, 173,
+	175, 176, 178, 179, 181, 182, 184, 185, 187, 188, 190, 191, 192, 194, 195, 196,
+	197, 199, 200, 201, 202, 204, 205, 206, 207, 208, 209, 210, 212, 213, 214, 215,
+	216, 217, 218, 219, 220, 221, 222, 223, 224, 225, 226, 227, 228, 228, 229, 230,
+	231, 232, 233, 234, 235, 235, 236, 237, 238, 239, 240, 240, 241, 242, 243, 243,
+	244, 245, 246, 246, 247, 248, 249, 249, 250, 251, 252, 252, 253, 254, 254, 255
+	},
+};
+
+const VelocityCurve velocity_curve_modes[5] = { VelLinear, VelExponential, VelLogarithmic, VelFixed, VelInverted };
+const VelSource vel_sources[4] = { VelSrcVelocity, VelSrcModWheel, VelSrcPressure, VelSrcPolyPressure };
+const GlideCurve glide_curve_modes[4] = { GlideLinear, GlideExponential, GlideLogarithmic, GlideSCurve };
+const PortamentoMode portamento_modes[3] = { PortamentoOff, PortamentoOn, PortamentoFingered };
 const RetrigMode retrig_modes[4] = { RetrigOff, Highest, Lowest, Latest };
 const TriggerMode trig_modes[3] = { Trig, Gate, TrigOff };
 
@@ -53,10 +123,18 @@ CvOutput::CvOutput(MidiController& mc, uint8_t ch):
 			notes_held {},
 			latest_notes()
 {
+	held_count = 0;
+	
 	is_sliding = false;
-	slide_start_ms = UINT32_MAX;
+	slide_start_us = UINT32_MAX;
 	slide_cur_length = UINT16_MAX;
-	slide_start_note = UINT8_MAX;
+	slide_scale = 0;
+	glide_code = 0;
+	glide_start_code = 0;
+	glide_interval = 0;
+	glide_end_code = 0;
+	glide_rate = 0;
+	glide_last_ms = 0;
 	slide_end_note = UINT8_MAX;
 	
 	vibrato_cur_offset = 0;
@@ -64,15 +142,56 @@ CvOutput::CvOutput(MidiController& mc, uint8_t ch):
 	
 	pitch_bend_amt = 0;
 	
+	vel_level = 0;
+	vel_base = 0;
+	vel_error = 0;
+	vel_dithering = false;
+	vel_target = 0;
+	
 	last_note_on_ms = UINT32_MAX;
+	last_dac_write_us = 0;
+	
+	// the note table is in EEPROM, it's checked once the settings are loaded
+	table_valid = 0;
 }
 
 
+/*
+	valid - the enums in range and the floats usable: a NaN or zero
+		calibration point would break every note of the output
+*/
+bool CvSettings::valid() const
+{
+	for (uint8_t i = 0; i < NUM_CAL_POINTS; i++)
+	{
+		if (!(calibration_points[i] > 0 && calibration_points[i] < 2 * DAC_CAL_VALUE))
+		{
+			return false;
+		}
+	}
+	
+	return trig_mode <= Gate
+		&& retrig_mode <= Latest
+		&& portamento_on <= PortamentoFingered
+		&& glide_curve <= GlideLogarithmic
+		&& glide_mode <= GlideConstantRate
+		&& vib_mode <= TempoSync
+		&& vib_tempo_div >= tempo_sync_divisions[7] && vib_tempo_div <= tempo_sync_divisions[0]
+		&& pitch_bend_range <= PITCH_BEND_MAX
+		&& vel_curve <= VelInverted
+		&& vel_dither <= 1
+		&& vel_source <= VelSrcPolyPressure;
+}
+
 void CvOutput::update_vibrato_offset()
 {
-	uint32_t elapsed = mctl.millis() - last_note_on_ms;
-	if (elapsed < settings.vib_delay_ms || settings.vib_depth_cents == 0)
+	uint32_t elapsed = mctl.now_ms() - last_note_on_ms;
+	int16_t depth_cents = settings.vib_depth_cents
+		+ (((int32_t) mctl.mod.value(ModDstVibDepth) * (int16_t) VIB_DEPTH_MAX) >> 15);
+	if (elapsed < settings.vib_delay_ms || depth_cents <= 0)
 	{
+		// no vibrato yet, or the matrix took it all away: back to the plain note
+		vibrato_cur_offset = 0;
 		return;
 	}
 	
@@ -82,12 +201,15 @@ void CvOutput::update_vibrato_offset()
 		? settings.vib_tempo_div * round(mctl.avg_midi_clock_period()) * 24
 		: settings.vib_period_ms;
 		
+	// the matrix takes up to half off, or adds up to half
+	period_ms -= ((int32_t) period_ms * mctl.mod.value(ModDstVibRate)) >> 16;
+		
 	// if we haven't been getting MIDI beat clocks we won't have a good tempo to use
 	period_ms = in_range(period_ms, VIB_PERIOD_MIN, VIB_PERIOD_MAX);
 		
 	//double scale_factor = sine_wave(elapsed, period_ms);
 	double scale_factor = triangle_wave(elapsed, period_ms);
-	vibrato_cur_offset = scale_factor * settings.vib_depth_cents / 100;
+	vibrato_cur_offset = scale_factor * depth_cents / 100;
 }
 
 /*
@@ -130,34 +252,63 @@ double CvOutput::triangle_wave(double t, double period, bool descend_first)
 
 void CvOutput::note_on(uint8_t midi_note, uint8_t velocity, uint8_t send_velocity, uint8_t add_to_latest)
 {
-	last_note_on_ms = mctl.millis();
+	last_note_on_ms = mctl.now_ms();
+	
+	// fingered portamento only slides if another note is still down (retriggers always are)
+	uint8_t legato = held_count > 0;
 	if (add_to_latest)
 	{
 		latest_notes.put(midi_note);
+		if (!notes_held[midi_note])
+		{
+			held_count++;
+		}
 		notes_held[midi_note] = velocity;
 	}
 	
 	vibrato_cur_offset = 0;
 	
-	// set the start and end note for the slide
-	slide_start_note = slide_end_note;
-	slide_end_note = midi_note;
-	if (slide_start_note == UINT8_MAX)
+	// the slide starts from wherever the pitch is now, even part way through another slide
+	glide_end_code = note_code(midi_note);
+	if (slide_end_note == UINT8_MAX)
 	{
 		// if this is the first note, there is no slide
-		slide_start_note = slide_end_note;
+		glide_code = (int32_t) glide_end_code << 16;
 	}
+	slide_end_note = midi_note;
+	
+	int32_t end_code = (int32_t) glide_end_code << 16;
 	
 	// set the time bounds for the slide and start the slide
-	slide_cur_length = slide_start_note > slide_end_note
+	slide_cur_length = end_code < glide_code
 							? settings.portamento_time_desc_user
 							: settings.portamento_time_asc_user;
-	slide_start_ms = mctl.millis();
-	is_sliding = settings.portamento_on && slide_cur_length > 0 && slide_start_note != slide_end_note;
+	int32_t length = slide_cur_length + (((int32_t) slide_cur_length * mctl.mod.value(ModDstGlideTime)) >> 15);
+	slide_cur_length = in_range(length, 0, UINT16_MAX);
+	slide_start_us = mctl.now_us();
+	is_sliding = (settings.portamento_on == PortamentoOn || (settings.portamento_on == PortamentoFingered && legato))
+					&& slide_cur_length > 0 && glide_code != end_code;
+	if (is_sliding && settings.glide_mode == GlideConstantRate)
+	{
+		// the slide time is per octave, so work out how far to move every ms once here
+		glide_rate = OCTAVE_CODE_FIXED / slide_cur_length;
+		if (end_code < glide_code)
+		{
+			glide_rate = -glide_rate;
+		}
+		glide_last_ms = mctl.now_ms();
+	}
+	else if (is_sliding)
+	{
+		glide_start_code = glide_code;
+		glide_interval = glide_end_code - (glide_code >> 16);
+		slide_scale = (1UL << 30) / (slide_cur_length * 1000UL);
+	}
 	
 	if (!is_sliding)
 	{
-		output_dac(dac_ch, midi_to_data(slide_end_note));
+		glide_code = end_code;
+		write_dac(code_to_data(glide_end_code));
 	}
 	else
 	{
@@ -167,7 +318,11 @@ void CvOutput::note_on(uint8_t midi_note, uint8_t velocity, uint8_t send_velocit
 	// write the velocity and send the trigger
 	if (dac_ch == 0)
 	{
-		VEL_A_DUTY = velocity * 0xFF / 0x7F;
+		if (settings.vel_source == VelSrcVelocity)
+		{
+			set_vel_level((uint16_t) velocity_duty(velocity) << 8);
+		}
+		
 		if (settings.trig_mode == Trig)
 		{   // the MidiController handles triggers in Poly mode
 			trigger_A();
@@ -179,9 +334,9 @@ void CvOutput::note_on(uint8_t midi_note, uint8_t velocity, uint8_t send_velocit
 	}
 	else
 	{
-		if (send_velocity)
+		if (send_velocity && settings.vel_source == VelSrcVelocity)
 		{
-			VEL_B_DUTY = velocity * 0xFF / 0x7F;
+			set_vel_level((uint16_t) velocity_duty(velocity) << 8);
 		}
 
 		if (settings.trig_mode == Trig)
@@ -197,6 +352,10 @@ void CvOutput::note_on(uint8_t midi_note, uint8_t velocity, uint8_t send_velocit
 
 void CvOutput::note_off(uint8_t midi_note, uint8_t vel)
 {
+	if (notes_held[midi_note])
+	{
+		held_count--;
+	}
 	notes_held[midi_note] = 0;
 	
 	int16_t note;
@@ -221,10 +380,11 @@ void CvOutput::note_off(uint8_t midi_note, uint8_t vel)
 
 void CvOutput::all_notes_off()
 {
-	for (int i = 0; i < 100; i++)
+	for (int i = 0; i < NUM_MIDI_NOTES; i++)
 	{
 		notes_held[i] = 0;
 	}
+	held_count = 0;
 	
 	while (latest_notes.ready())
 	{
@@ -238,31 +398,213 @@ void CvOutput::all_notes_off()
 void CvOutput::slide_progress()
 {
 	update_vibrato_offset();
+	if (is_sliding && settings.glide_mode == GlideConstantRate)
+	{
+		glide_step();
+		return;
+	}
+	
 	if (is_sliding)
 	{
-		uint32_t elapsed = mctl.millis() - slide_start_ms;
-		if (elapsed >= slide_cur_length)
+		uint32_t elapsed = mctl.now_us() - slide_start_us;
+		uint32_t length = slide_cur_length * 1000UL;
+		if (elapsed >= length)
 		{
 			// the slide is complete
 			is_sliding = false;
-			
-			output_dac(dac_ch, midi_to_data(slide_end_note));
+			glide_code = (int32_t) glide_end_code << 16;
 		}
 		else
 		{
-			// the slide is ongoing
-			uint16_t start_data = midi_to_data(slide_start_note);
-			uint16_t end_data = midi_to_data(slide_end_note);
-			int16_t interval = end_data - start_data;
-			int16_t inc = ((float) elapsed  * interval) / (float) slide_cur_length;
+			// the slide is ongoing: interval * shape is already a 16.16 code offset
+			uint16_t shape = glide_shape((elapsed * slide_scale) >> 14);
+			glide_code = glide_start_code + (int32_t) glide_interval * shape;
+		}
+	}
+	
+	// also keeps vibrato going once the slide is done
+	write_dac(code_to_data(glide_code >> 16));
+}
 
-			output_dac(dac_ch, start_data + inc);
+/*
+	glide_step - moves a constant rate slide on by glide_rate for every ms
+		since the last update, stopping once it reaches the end note
+*/
+void CvOutput::glide_step()
+{
+	uint32_t now = mctl.now_ms();
+	int32_t end_code = (int32_t) glide_end_code << 16;
+	
+	while (glide_last_ms != now)
+	{
+		glide_last_ms++;
+		glide_code += glide_rate;
+		if (glide_rate > 0 ? glide_code >= end_code : glide_code <= end_code)
+		{
+			glide_code = end_code;
+			is_sliding = false;
+			break;
 		}
 	}
-	else // check for vibrato
+	
+	write_dac(code_to_data(glide_code >> 16));
+}
+
+/*
+	glide_shape - how far along the glide curve the pitch should be, PROGRESS and
+		the result are both fractions of the slide from 0 to 0xFFFF. The curve
+		tables are interpolated between their points so this is integer only.
+*/
+uint16_t CvOutput::glide_shape(uint16_t progress)
+{
+	if (settings.glide_curve == GlideLinear || settings.glide_curve > GlideLogarithmic)
+	{
+		return progress;
+	}
+	
+	const uint16_t* curve = glide_curves[settings.glide_curve - GlideExponential];
+	uint8_t idx = progress >> GLIDE_CURVE_SEGMENT_BITS;
+	uint8_t frac = progress >> (GLIDE_CURVE_SEGMENT_BITS - 8);
+	uint16_t a = pgm_read_word(&curve[idx]);
+	uint16_t b = pgm_read_word(&curve[idx + 1]);
+	
+	return a + (((uint32_t) (b - a) * frac) >> 8);
+}
+
+/*
+	velocity_duty - the VEL output PWM duty for VELOCITY through the selected curve
+*/
+uint8_t CvOutput::velocity_duty(uint8_t velocity)
+{
+	velocity &= 0x7F;
+	switch (settings.vel_curve)
+	{
+		case VelExponential:	return pgm_read_byte(&velocity_curves[VelExponential][velocity]);
+		case VelLogarithmic:	return pgm_read_byte(&velocity_curves[VelLogarithmic][velocity]);
+		case VelFixed:			return 0xFF;
+		case VelInverted:		return pgm_read_byte(&velocity_curves[VelLinear][0x7F - velocity]);
+		default:				return pgm_read_byte(&velocity_curves[VelLinear][velocity]);
+	}
+}
+
+/*
+	set_vel_level - sets the VEL output to LEVEL, an 8.8 fixed point duty.
+		Without dithering the fraction is dropped, with it the top two bits
+		of the fraction are kept.
+*/
+void CvOutput::set_vel_level(uint16_t level)
+{
+	vel_base = level;
+	apply_vel_mod();
+}
+
+/*
+	apply_vel_mod - adds the modulation matrix to vel_base and sets the output
+*/
+void CvOutput::apply_vel_mod()
+{
+	int32_t level = vel_base + ((int32_t) mctl.mod.value((ModDest) (ModDstVelA + dac_ch)) << 1);
+	level = in_range(level, 0, 0xFF00);
+	bool dither = settings.vel_dither && (level & VEL_DITHER_MASK) && level < 0xFF00;
+	if (level == vel_level && dither == vel_dithering)
+	{
+		return;
+	}
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		output_dac(dac_ch, midi_to_data(slide_end_note));
-	}		
+		vel_level = level;
+		vel_dithering = dither;
+		write_vel(level >> 8);
+	}
+	mctl.update_dither();
+}
+
+/*
+	dither_velocity - called from the Timer0 overflow interrupt every
+		VEL_DITHER_PERIODS PWM periods while an output is dithering. The top
+		bits of the level's fraction are added to an error accumulator and
+		the duty is one higher every time it carries (first order
+		sigma-delta), so the filtered VEL output averages out to the level.
+		With two fraction bits the pattern is at most 4 steps long, which
+		keeps the noise at 3.9kHz and up, well clear of the VEL filter.
+*/
+void CvOutput::dither_velocity()
+{
+	if (!vel_dithering)
+	{
+		return;
+	}
+	
+	uint8_t duty = vel_level >> 8;
+	uint16_t sum = vel_error + (vel_level & VEL_DITHER_MASK);
+	vel_error = sum;
+	if (sum > 0xFF)
+	{
+		duty++; // vel_dithering is never set at full scale
+	}
+	write_vel(duty);
+}
+
+void CvOutput::write_vel(uint8_t duty)
+{
+	if (dac_ch == 0)
+	{
+		VEL_A_DUTY = duty;
+	}
+	else
+	{
+		VEL_B_DUTY = duty;
+	}
+}
+
+/*
+	modulation - a new value from a continuous controller. If it's the one the
+		VEL output follows it becomes the slew limiter's target, the output
+		itself only moves in update_velocity, so dense CC streams cost little.
+*/
+void CvOutput::modulation(VelSource source, uint8_t value)
+{
+	if (settings.vel_source == source)
+	{
+		vel_target = (uint16_t) velocity_duty(value) << 8;
+	}
+}
+
+/*
+	poly_pressure - only the pressure on the note being played is used
+*/
+void CvOutput::poly_pressure(uint8_t midi_note, uint8_t pressure)
+{
+	if (midi_note == slide_end_note)
+	{
+		modulation(VelSrcPolyPressure, pressure);
+	}
+}
+
+/*
+	update_velocity - called every ms: moves the VEL level towards vel_target
+		by at most vel_slew
+*/
+void CvOutput::update_velocity()
+{
+	uint16_t level = vel_base;
+	if (settings.vel_source == VelSrcVelocity || level == vel_target)
+	{
+		apply_vel_mod();
+		return;
+	}
+	
+	uint16_t step = settings.vel_slew ? settings.vel_slew : UINT16_MAX;
+	if (level < vel_target)
+	{
+		level = vel_target - level > step ? level + step : vel_target;
+	}
+	else
+	{
+		level = level - vel_target > step ? level - step : vel_target;
+	}
+	set_vel_level(level);
 }
 
 /*
@@ -273,7 +615,7 @@ void CvOutput::pitch_bend(int16_t amt)
 	// get it into the range -1 to 1
 	pitch_bend_amt = (((float) amt + 8192) / 16383) * 2 - 1;
 
-	output_dac(dac_ch, midi_to_data(slide_end_note));
+	write_dac(code_to_data(glide_code >> 16));
 }
 
 /*
@@ -282,25 +624,137 @@ void CvOutput::pitch_bend(int16_t amt)
 */
 uint16_t CvOutput::midi_to_data(uint8_t midi_note)
 {
-	midi_note = in_range(midi_note, MIDI_NOTE_MIN, MIDI_NOTE_MAX);
-	midi_note -= MIDI_NOTE_MIN;
-	
-	double calibration_val = interpolate_calibration_value(midi_note);
-	int32_t base_note = midi_note * calibration_val;
+	return code_to_data(note_code(midi_note));
+}
+
+/*
+	note_code - the calibrated DAC code of a note, before pitch bend and vibrato.
+		Only read once per NoteOn, so the table can stay in EEPROM. Notes it
+		doesn't have right yet are worked out instead (see update_note_table).
+*/
+uint16_t CvOutput::note_code(uint8_t midi_note)
+{
+	uint8_t note = in_range(midi_note, MIDI_NOTE_MIN, MIDI_NOTE_MAX) - MIDI_NOTE_MIN;
+	if (note >= table_valid)
+	{
+		return calc_note_code(note);
+	}
+	return eeprom_read_word(note_codes() + note);
+}
+
+uint16_t* CvOutput::note_codes()
+{
+	return (uint16_t*) NOTE_CODES_ADDR + dac_ch * NUM_NOTES;
+}
+
+/*
+	code_to_data - adds the current pitch bend and vibrato to a DAC code
+*/
+uint16_t CvOutput::code_to_data(int32_t base_note)
+{
 	int32_t pb_offset = pitch_bend_amt * settings.pitch_bend_range * DAC_CAL_VALUE;
 	int32_t vib_offset = vibrato_cur_offset * DAC_CAL_VALUE;
 	
-	int32_t dac_data = base_note + pb_offset + vib_offset;
+	int32_t mod_offset = ((int32_t) mctl.mod.value((ModDest) (ModDstPitchA + dac_ch)) * OCTAVE_CODE) >> 15;
+	
+	int32_t dac_data = base_note + pb_offset + vib_offset + mod_offset;
 	dac_data = in_range(dac_data, DAC_MIN, DAC_MAX);
 	
 	return dac_data;
 }
 
+/*
+	build_note_table - call whenever the calibration points or the note
+		offsets change: note_code works the notes out from them until
+		update_note_table has brought the EEPROM table up to date again
+*/
+void CvOutput::build_note_table()
+{
+	table_valid = 0;
+}
+
+/*
+	update_note_table - checks the next note of the EEPROM table, which
+		expands the calibration points into the DAC code of every note so a
+		NoteOn doesn't have to interpolate. Called from a low priority task:
+		a byte that changed is only written if the EEPROM is free, and the
+		3.3ms the write takes run in the background, so the loop and MIDI
+		never wait for a rebuild. At boot nothing changed and it only reads.
+		False once the table is up to date.
+*/
+bool CvOutput::update_note_table()
+{
+	if (table_valid == NUM_NOTES)
+	{
+		return false;
+	}
+	
+	if (!eeprom_is_ready())
+	{
+		return true;
+	}
+	
+	uint8_t* addr = (uint8_t*) (note_codes() + table_valid);
+	uint16_t code = calc_note_code(table_valid);
+	for (uint8_t i = 0; i < 2; i++)
+	{
+		uint8_t value = i ? code >> 8 : code & 0xFF; // eeprom_read_word is little endian
+		if (eeprom_read_byte(addr + i) != value)
+		{
+			eeprom_write_byte(addr + i, value);
+			return true; // the other byte waits for the next call
+		}
+	}
+	
+	table_valid++;
+	return true;
+}
+
+/*
+	calc_note_code - the code of NOTE (0 = MIDI_NOTE_MIN) from the
+		calibration points, corrected by its saved per-note offset
+*/
+uint16_t CvOutput::calc_note_code(uint8_t note)
+{
+	int32_t code = note * interpolate_calibration_value(note);
+	code += lround(note_offset(note) * DAC_CAL_VALUE / 100);
+	return in_range(code, DAC_MIN, DAC_MAX);
+}
+
+/*
+	note_offset - the saved offset of NOTE (0 = MIDI_NOTE_MIN) in cents,
+		0 if offsets have never been saved
+*/
+int8_t CvOutput::note_offset(uint8_t note)
+{
+	const uint8_t* offsets = (const uint8_t*) NOTE_OFFSETS_ADDR;
+	if (eeprom_read_byte(offsets) != NOTE_OFFSETS_MAGIC)
+	{
+		return 0;
+	}
+	return eeprom_read_byte(offsets + 1 + dac_ch * NUM_NOTES + note);
+}
+
+/*
+	write_dac - sets this output's DAC channel, keeping track of how often
+		it gets written for the DAC-write interval histogram
+*/
+void CvOutput::write_dac(uint16_t data)
+{
+	uint32_t now = mctl.micros();
+	mctl.histograms[HistDacInterval].add(now - last_dac_write_us);
+	last_dac_write_us = now;
+	
+	output_dac(dac_ch, data);
+}
+
 /*
 	output_dac - sends config bits and 12 bits of data to DAC
 */
 void CvOutput::output_dac(uint8_t channel, uint16_t data)
 {
+	TRACE_SCOPE(DAC);
+	
 	DAC_CS_PORT &= ~(1<<DAC_CS);	//pull CS low to enable DAC
 	
 	SPDR = (channel<<MCP4822_ABSEL) | (0<<MCP4822_IGN) | (0<<MCP4822_GAIN) | (1<<MCP4822_SHDN) | ((data>>8) & 0x0F);
@@ -363,6 +817,13 @@ uint16_t CvOutput::calculate_ocr_value(uint16_t ms) {
 #define CC_VibratoDepth			MIDI_NAMESPACE::SoundController8
 #define CC_VibratoDelay			MIDI_NAMESPACE::SoundController9
 #define CC_VibratoSync			MIDI_NAMESPACE::SoundController10 // 79. Value: on or off
+#define CC_GlideCurve			86 // undefined: 0-31 linear, 32-63 exponential, 64-95 logarithmic, 96-127 s-curve
+#define CC_GlideMode			87 // undefined: 0-63 constant time, 64-127 constant rate (time per octave)
+#define CC_PortamentoMode		88 // undefined: 0-42 off, 43-85 always, 86-127 fingered
+#define CC_VelocityCurve		102 // undefined: linear, exponential, logarithmic, fixed, inverted in steps of 26
+#define CC_VelocityDither		103 // undefined: 0-63 off, 64-127 on
+#define CC_VelocitySource		104 // undefined: velocity, mod wheel, channel pressure, poly pressure in steps of 32
+#define CC_VelocitySlew			105 // undefined: 0 = no limit, else up to VEL_SLEW_MAX for a full scale change
 
 void CvOutput::control_change(uint8_t cc_num, uint8_t cc_val)
 {
@@ -374,7 +835,11 @@ void CvOutput::control_change(uint8_t cc_num, uint8_t cc_val)
 			break;
 			
 		case CC_PortamentoOnOff:
-			settings.portamento_on = cc_val > 63;
+			settings.portamento_on = cc_val > 63 ? PortamentoOn : PortamentoOff;
+			break;
+			
+		case CC_PortamentoMode:
+			settings.portamento_on = portamento_modes[cc_val / 43];
 			break;
 			
 		case CC_PortamentoTime:
@@ -391,6 +856,34 @@ void CvOutput::control_change(uint8_t cc_num, uint8_t cc_val)
 			settings.portamento_time_asc_user =  (cc_val * MAX_SLIDE_LENGTH) / 127.0;
 			break;
 		
+		case CC_GlideCurve:
+			settings.glide_curve = glide_curve_modes[cc_val / 32];
+			break;
+		
+		case CC_VelocityCurve:
+			settings.vel_curve = velocity_curve_modes[cc_val / 26];
+			break;
+		
+		case MIDI_NAMESPACE::ModulationWheel:
+			modulation(VelSrcModWheel, cc_val);
+			break;
+		
+		case CC_VelocitySource:
+			settings.vel_source = vel_sources[cc_val / 32];
+			break;
+		
+		case CC_VelocitySlew:
+			settings.vel_slew = cc_val ? 0xFF00 / (cc_val * VEL_SLEW_MAX / 127) : 0;
+			break;
+		
+		case CC_VelocityDither:
+			settings.vel_dither = cc_val > 63;
+			break;
+		
+		case CC_GlideMode:
+			settings.glide_mode = cc_val > 63 ? GlideConstantRate : GlideConstantTime;
+			break;
+		
 		case CC_TrigLength:
 			settings.trigger_duration_ms = (cc_val * MAX_TRIG_LENGTH / 127.0);
 			if (settings.trigger_duration_ms < 1) settings.trigger_duration_ms = 1;
@@ -472,7 +965,7 @@ double CvOutput::interpolate_calibration_value(uint8_t note) {
 
 int16_t CvOutput::highest()
 {
-	for (int i = 99; i >= 0; i--)
+	for (int i = NUM_MIDI_NOTES - 1; i >= 0; i--)
 		if (notes_held[i])
 			return i;
 			
@@ -481,7 +974,7 @@ int16_t CvOutput::highest()
 
 int16_t CvOutput::lowest()
 {
-	for (int i = 0; i < 100; i++)
+	for (int i = 0; i < NUM_MIDI_NOTES; i++)
 		if (notes_held[i])
 			return i;
 			
@@ -17,17 +17,39 @@
 
 #define LATEST_NOTES_SIZE 20 
 
+#define NUM_MIDI_NOTES 128	/* notes_held covers every MIDI note, in range of the DAC or not */
 #define MIDI_NOTE_MIN 24
 #define MIDI_NOTE_MAX 111
+#define NUM_NOTES (MIDI_NOTE_MAX - MIDI_NOTE_MIN + 1)
 #define DAC_CAL_VALUE 47.068966d
 #define NUM_CAL_POINTS 8
 
+/* per-note calibration offsets: magic byte, then NUM_NOTES int8 cents per
+   DAC channel (saved by save_note_offset, see EEPromManager.h) */
+#define NOTE_OFFSETS_ADDR	0x100	/* well past the end of the settings */
+#define NOTE_OFFSETS_MAGIC	0xCE
+
+/* the expanded note tables live in EEPROM after them: NUM_NOTES words per
+   DAC channel, rewritten in the background (see update_note_table) */
+#define NOTE_CODES_ADDR 0x200
+
+/* VEL dithering (see dither_velocity) steps every VEL_DITHER_PERIODS periods
+   of the 62.5kHz PWM and only uses the top fraction bits of the level, so
+   its pattern repeats at 15.6kHz / 4 = 3.9kHz or faster */
+#define VEL_DITHER_PERIODS	4
+#define VEL_DITHER_MASK		0x00C0
+
 class MidiController;
 
 enum TriggerMode { TrigOff, Trig, Gate };
 enum RetrigMode  { RetrigOff, Highest, Lowest, Latest };
 enum VibratoMode { VibratoOff, Free, TempoSync };
 enum VibratoLFO { Bipolar, HalfWave, Rectified };
+enum GlideCurve { GlideLinear, GlideExponential, GlideSCurve, GlideLogarithmic };
+enum GlideMode  { GlideConstantTime, GlideConstantRate };
+enum PortamentoMode { PortamentoOff, PortamentoOn, PortamentoFingered };
+enum VelocityCurve { VelLinear, VelExponential, VelLogarithmic, VelFixed, VelInverted };
+enum VelSource { VelSrcVelocity, VelSrcModWheel, VelSrcPressure, VelSrcPolyPressure };
 
 template <typename T, typename U, typename V>
 static T in_range(T val, U min, V max)
@@ -45,9 +67,11 @@ public:
 	uint8_t trigger_duration_ms = 1;
 
 	/* Portamento configuration */
-	uint8_t portamento_on = false;
-	uint16_t portamento_time_asc_user = 0;
+	uint8_t portamento_on = PortamentoOff;	/* PortamentoMode: fingered only slides between overlapping notes */
+	uint16_t portamento_time_asc_user = 0;	/* ms per slide, or ms per octave when GlideConstantRate */
 	uint16_t portamento_time_desc_user = 0;
+	GlideCurve glide_curve = GlideLinear;	/* GlideConstantTime only, constant rate slides are linear */
+	GlideMode glide_mode = GlideConstantTime;
 
 	/* Vibrato configuration */
 	VibratoMode vib_mode = VibratoOff;
@@ -59,6 +83,12 @@ public:
 	/* Pitch Bend configuration */
 	uint8_t pitch_bend_range = 2;
 
+	/* velocity => VEL output PWM duty */
+	VelocityCurve vel_curve = VelLinear;
+	uint8_t vel_dither = false;		/* sigma-delta the VEL level onto the 8-bit PWM, 10 bits effective */
+	VelSource vel_source = VelSrcVelocity;	/* what the VEL output follows */
+	uint16_t vel_slew = 0;			/* most the VEL level moves per ms (8.8 duty), 0 = no limit */
+
 	/* DAC V/oct digital calibration table: one calibration per C in each octave */
 	float calibration_points[NUM_CAL_POINTS];
 
@@ -66,92 +96,30 @@ public:
 									   DAC_CAL_VALUE - 0.21, DAC_CAL_VALUE - 0.15, DAC_CAL_VALUE - 0.15, DAC_CAL_VALUE - 0.15 }
 	{	}
 
-	void serialize(uint8_t* buffer) const override
-	{
-		size_t offset = 0;
-
-		buffer[offset++] = (uint8_t) trig_mode;
-		buffer[offset++] = (uint8_t) retrig_mode;
-		buffer[offset++] = trigger_duration_ms;
-		buffer[offset++] = portamento_on;
-
-		memcpy(buffer + offset, &portamento_time_asc_user, sizeof(portamento_time_asc_user));
-		offset += sizeof(portamento_time_asc_user);
-
-		memcpy(buffer + offset, &portamento_time_desc_user, sizeof(portamento_time_desc_user));
-		offset += sizeof(portamento_time_desc_user);
-
-		buffer[offset++] = (uint8_t) vib_mode;
-
-		memcpy(buffer + offset, &vib_period_ms, sizeof(vib_period_ms));
-		offset += sizeof(vib_period_ms);
-
-		memcpy(buffer + offset, &vib_depth_cents, sizeof(vib_depth_cents));
-		offset += sizeof(vib_depth_cents);
-
-		memcpy(buffer + offset, &vib_delay_ms, sizeof(vib_delay_ms));
-		offset += sizeof(vib_delay_ms);
-
-		memcpy(buffer + offset, &vib_tempo_div, sizeof(vib_tempo_div));
-		offset += sizeof(vib_tempo_div);
-
-		buffer[offset++] = pitch_bend_range;
-
-		memcpy(buffer + offset, calibration_points, sizeof(calibration_points));
-		offset += sizeof(calibration_points);
-	}
-
-	void deserialize(const uint8_t* buffer) override
+	void walk(SerialCursor& c) override
 	{
-		size_t offset = 0;
-
-		trig_mode = static_cast<TriggerMode>(buffer[offset++]);
-		retrig_mode = static_cast<RetrigMode>(buffer[offset++]);
-		trigger_duration_ms = buffer[offset++];
-		portamento_on = buffer[offset++];
-
-		memcpy(&portamento_time_asc_user, buffer + offset, sizeof(portamento_time_asc_user));
-		offset += sizeof(portamento_time_asc_user);
-
-		memcpy(&portamento_time_desc_user, buffer + offset, sizeof(portamento_time_desc_user));
-		offset += sizeof(portamento_time_desc_user);
-
-		vib_mode = (VibratoMode) buffer[offset++];
-
-		memcpy(&vib_period_ms, buffer + offset, sizeof(vib_period_ms));
-		offset += sizeof(vib_period_ms);
-
-		memcpy(&vib_depth_cents, buffer + offset, sizeof(vib_depth_cents));
-		offset += sizeof(vib_depth_cents);
-
-		memcpy(&vib_delay_ms, buffer + offset, sizeof(vib_delay_ms));
-		offset += sizeof(vib_delay_ms);
-
-		memcpy(&vib_tempo_div, buffer + offset, sizeof(vib_tempo_div));
-		offset += sizeof(vib_tempo_div);
-
-		pitch_bend_range = buffer[offset++];
-
-		memcpy(calibration_points, buffer + offset, sizeof(calibration_points));
-		offset += sizeof(calibration_points);
-	}
-
-	size_t size_bytes() const override
-	{
-		return	sizeof(trig_mode) +
-				sizeof(retrig_mode) +
-				sizeof(trigger_duration_ms) +
-				sizeof(portamento_on) +
-				sizeof(portamento_time_asc_user) +
-				sizeof(portamento_time_desc_user) +
-				sizeof(vib_mode) +
-				sizeof(vib_period_ms) +
-				sizeof(vib_depth_cents) +
-				sizeof(vib_delay_ms) +
-				sizeof(vib_tempo_div) +
-				sizeof(pitch_bend_range) +
-				sizeof(calibration_points);
+		c.field(&trig_mode, sizeof(trig_mode));
+		c.field(&retrig_mode, sizeof(retrig_mode));
+		c.field(&trigger_duration_ms, sizeof(trigger_duration_ms));
+		c.field(&portamento_on, sizeof(portamento_on));
+		c.field(&portamento_time_asc_user, sizeof(portamento_time_asc_user));
+		c.field(&portamento_time_desc_user, sizeof(portamento_time_desc_user));
+		c.field(&vib_mode, sizeof(vib_mode));
+		c.field(&vib_period_ms, sizeof(vib_period_ms));
+		c.field(&vib_depth_cents, sizeof(vib_depth_cents));
+		c.field(&vib_delay_ms, sizeof(vib_delay_ms));
+		c.field(&vib_tempo_div, sizeof(vib_tempo_div));
+		c.field(&pitch_bend_range, sizeof(pitch_bend_range));
+		c.field(calibration_points, sizeof(calibration_points));
+		c.field(&glide_curve, sizeof(glide_curve));
+		c.field(&glide_mode, sizeof(glide_mode));
+		c.field(&vel_curve, sizeof(vel_curve));
+		c.field(&vel_dither, sizeof(vel_dither));
+		c.field(&vel_source, sizeof(vel_source));
+		c.field(&vel_slew, sizeof(vel_slew));
 	}
+	
+	bool valid() const override;
 };
 
 class CvOutput
@@ -165,15 +133,25 @@ public:
 	VibratoLFO vib_lfo;
 	uint8_t dac_ch;
 	
-	uint8_t notes_held[100];
+	uint8_t notes_held[NUM_MIDI_NOTES];
+	uint8_t held_count;		/* how many entries of notes_held are set */
 	CircularBuffer<int16_t, LATEST_NOTES_SIZE> latest_notes;
 	
 	/* state to keep track of slide progress */
 	volatile uint8_t is_sliding;
-	volatile uint32_t slide_start_ms;
+	volatile uint32_t slide_start_us;
 	volatile uint16_t slide_cur_length;
-	volatile uint8_t slide_start_note;
 	volatile uint8_t slide_end_note;
+	volatile uint32_t slide_scale;	/* 2^30 / slide length in us: progress = elapsed * slide_scale */
+	
+	/* instantaneous pitch as a 16.16 fixed point DAC code, before pitch bend and vibrato.
+		New slides start from here, so a note arriving mid-slide doesn't jump */
+	int32_t glide_code;
+	int32_t glide_start_code;
+	int16_t glide_interval;		/* end - start in whole codes, for constant time slides */
+	uint16_t glide_end_code;
+	int32_t glide_rate;			/* added every ms by constant rate slides */
+	uint32_t glide_last_ms;
 	
 	/* how many semitones of vibrato are currently applied */
 	float vibrato_cur_offset;
@@ -181,7 +159,18 @@ public:
 	/* scale factor for current amount of pitch bend (-1 to 1) */
 	float pitch_bend_amt;
 	
+	/* VEL output level, 8.8 fixed point PWM duty (see dither_velocity):
+		vel_base from the velocity or its slew limiter, plus the modulation matrix */
+	volatile uint16_t vel_level;
+	volatile bool vel_dithering;	/* vel_dither is on and the level has a fraction to dither */
+	uint8_t vel_error;
+	uint16_t vel_base;
+	uint16_t vel_target;	/* where the slew limiter is taking vel_base (see update_velocity) */
+	
 	uint32_t last_note_on_ms;
+	uint32_t last_dac_write_us;
+	
+	uint8_t table_valid;	/* notes below this are up to date in the EEPROM note table */
 
 public:
 	CvOutput(MidiController& mc, uint8_t dac_channel);
@@ -190,16 +179,34 @@ public:
 	void control_change(uint8_t cc_num, uint8_t cc_val);
 	
 	void slide_progress();
+	uint16_t glide_shape(uint16_t progress);
+	void glide_step();
 	void pitch_bend(int16_t amt);
 	void update_vibrato_offset();
 	double triangle_wave(double t, double period, bool desc_first = false);
 	double sine_wave(double t, double period);
 	
+	uint8_t velocity_duty(uint8_t velocity);
+	void set_vel_level(uint16_t level);
+	void dither_velocity();
+	void write_vel(uint8_t duty);
+	void modulation(VelSource source, uint8_t value);
+	void poly_pressure(uint8_t midi_note, uint8_t pressure);
+	void update_velocity();
+	void apply_vel_mod();
 	void trigger_A();
 	void trigger_B();
 	
+	void write_dac(uint16_t data);
 	static void output_dac(uint8_t channel, uint16_t data);
 	uint16_t midi_to_data(uint8_t midi_note);
+	uint16_t note_code(uint8_t midi_note);
+	uint16_t* note_codes();
+	uint16_t code_to_data(int32_t code);
+	void build_note_table();
+	bool update_note_table();
+	uint16_t calc_note_code(uint8_t note);
+	int8_t note_offset(uint8_t note);
 	
 	uint16_t calculate_ocr_value(uint16_t duration_ms);
 	
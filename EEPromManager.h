@@ -12,65 +12,172 @@
 #include <avr/interrupt.h>
 
 #include "MidiController.h"
+#include "Trace.h"
 
-size_t save_object_to_eeprom(Serializable* obj, uint8_t offset)
+/* the per-note calibration offsets and the note tables built from them are
+   at NOTE_OFFSETS_ADDR and NOTE_CODES_ADDR (see CvOutput.h) */
+
+#define CONFIG_MAGIC	0xBB
+#define CONFIG_VERSION	0xC4	/* layout of the settings image: change it whenever a Serializable changes */
+#define CONFIG_ADDR		1		/* the image starts with its version byte, right after the magic byte */
+
+#define CONFIG_PARTS	4
+
+/*
+	config_parts - the settings objects, in the order they're imaged after
+		the version byte
+*/
+void config_parts(MidiController& mctl, Serializable** parts)
+{
+	parts[0] = &mctl.settings;
+	parts[1] = &mctl.cv_out_a.settings;
+	parts[2] = &mctl.cv_out_b.settings;
+	parts[3] = &mctl.mod.settings;
+}
+
+size_t config_size(MidiController& mctl)
 {
-	size_t size = obj->size_bytes();
-	uint8_t buf[size];
-	obj->serialize((uint8_t*) buf);
-	eeprom_write_block(buf, (void*) offset, size);
+	Serializable* parts[CONFIG_PARTS];
+	config_parts(mctl, parts);
+	
+	size_t size = 1;
+	for (uint8_t i = 0; i < CONFIG_PARTS; i++)
+	{
+		size += parts[i]->size_bytes();
+	}
 	return size;
 }
 
+/*
+	image_byte - where byte IDX of the settings image made of PARTS lives
+		(the version byte not counted), nullptr past the end
+*/
+uint8_t* image_byte(Serializable** parts, size_t idx)
+{
+	for (uint8_t i = 0; i < CONFIG_PARTS; i++)
+	{
+		size_t size = parts[i]->size_bytes();
+		if (idx < size)
+		{
+			return parts[i]->byte(idx);
+		}
+		idx -= size;
+	}
+	return nullptr;
+}
+
+/*
+	config_byte - where byte IDX of the settings image lives, nullptr for
+		the version byte (0) and past the end. The same image is saved to
+		EEPROM and sent as the SysEx config dump.
+*/
+uint8_t* config_byte(MidiController& mctl, size_t idx)
+{
+	Serializable* parts[CONFIG_PARTS];
+	config_parts(mctl, parts);
+	
+	return idx == 0 ? nullptr : image_byte(parts, idx - 1);
+}
+
 void save_config(MidiController& mctl)
 {
+	TRACE_SCOPE(EEPROM);
 	cli(); // disable interrupts globally
 	
 	ledc_red();
 	
-	uint8_t offset = 0;
+	// only the bytes that changed are written
+	eeprom_update_byte((uint8_t*) 0, CONFIG_MAGIC);
+	eeprom_update_byte((uint8_t*) CONFIG_ADDR, CONFIG_VERSION);
 	
-	eeprom_write_byte((uint8_t*) offset++, 0xBB);
-	eeprom_write_byte((uint8_t*) offset++, 0xBB);
+	Serializable* parts[CONFIG_PARTS];
+	config_parts(mctl, parts);
 	
-	offset += save_object_to_eeprom(&mctl.settings,			 offset);
-	offset += save_object_to_eeprom(&mctl.cv_out_a.settings, offset);
-	offset += save_object_to_eeprom(&mctl.cv_out_b.settings, offset);
+	uint8_t* addr = (uint8_t*) CONFIG_ADDR + 1;
+	for (uint8_t i = 0; i < CONFIG_PARTS; i++)
+	{
+		size_t size = parts[i]->size_bytes();
+		for (size_t j = 0; j < size; j++)
+		{
+			eeprom_update_byte(addr++, *parts[i]->byte(j));
+		}
+	}
 	
 	ledc_green();
 	
 	sei(); // enable interrupts globally
 }
 
+/*
+	load_config - loads the saved settings, nothing is changed if there are
+		none or they were written by a different layout version
+*/
 bool load_config(MidiController& mctl)
 {
 	ledc_red();
 	
-	if (eeprom_read_byte((uint8_t*) 0) != 0xBB || eeprom_read_byte((uint8_t*) 1) != 0xBB)
+	if (eeprom_read_byte((uint8_t*) 0) != CONFIG_MAGIC ||
+		eeprom_read_byte((uint8_t*) CONFIG_ADDR) != CONFIG_VERSION)
 	{
-		ledc_red();
 		return false;
 	}
 	
-	size_t size_mctl = mctl.settings.size_bytes();
-	size_t size_cvA = mctl.cv_out_a.settings.size_bytes();
-	size_t size_cvB = mctl.cv_out_b.settings.size_bytes();
-	
-	byte buf_mctl[size_mctl], buf_cvA[size_cvA], buf_cvB[size_cvB];
-	
-	size_t offset = 2; /* dummy 0xBB bytes */
-	eeprom_read_block(buf_mctl, (void*) offset,							size_mctl);
-	eeprom_read_block(buf_cvA,	(void*) size_mctl + offset,				size_cvA);
-	eeprom_read_block(buf_cvB,	(void*) size_mctl + offset + size_cvA,	size_cvB);
+	Serializable* parts[CONFIG_PARTS];
+	config_parts(mctl, parts);
 	
-	mctl.settings.deserialize(buf_mctl);
-	mctl.cv_out_a.settings.deserialize(buf_cvA);
-	mctl.cv_out_b.settings.deserialize(buf_cvB);
+	const uint8_t* addr = (const uint8_t*) CONFIG_ADDR + 1;
+	for (uint8_t i = 0; i < CONFIG_PARTS; i++)
+	{
+		size_t size = parts[i]->size_bytes();
+		for (size_t j = 0; j < size; j++)
+		{
+			*parts[i]->byte(j) = eeprom_read_byte(addr++);
+		}
+	}
 	
 	ledc_green();
 	
 	return true;
 }
 
+uint8_t* note_offsets_addr(uint8_t dac_ch)
+{
+	return (uint8_t*) NOTE_OFFSETS_ADDR + 1 + dac_ch * NUM_NOTES;
+}
+
+bool note_offsets_saved()
+{
+	return eeprom_read_byte((uint8_t*) NOTE_OFFSETS_ADDR) == NOTE_OFFSETS_MAGIC;
+}
+
+/*
+	save_note_offset - saves the offset of NOTE (0 = MIDI_NOTE_MIN) for DAC_CH
+*/
+void save_note_offset(uint8_t dac_ch, uint8_t note, int8_t cents)
+{
+	TRACE_SCOPE(EEPROM);
+	if (!note_offsets_saved())
+	{
+		// first save: clear both outputs so the other one doesn't read erased (0xFF) bytes
+		for (uint8_t i = 0; i < 2 * NUM_NOTES; i++)
+		{
+			eeprom_update_byte(note_offsets_addr(0) + i, 0);
+		}
+		eeprom_update_byte((uint8_t*) NOTE_OFFSETS_ADDR, NOTE_OFFSETS_MAGIC);
+	}
+	
+	eeprom_update_byte(note_offsets_addr(dac_ch) + note, cents);
+}
+
+/*
+	load_note_tables - has the note tables of both outputs rebuilt from their
+		calibration points and saved per-note offsets (see update_note_table)
+*/
+void load_note_tables(MidiController& mctl)
+{
+	mctl.cv_out_a.build_note_table();
+	mctl.cv_out_b.build_note_table();
+}
+
 
 #endif /* ROMLAYOUT_H_ */
\ No newline at end of file
@@ -9,6 +9,7 @@
 #include <avr/interrupt.h>
 
 #include "GPIO.h"
+#include "Trace.h"
 
 /***************************************************/
 /*	TIMER 0 - fast PWM with outputs on PD6 and PD3 */
@@ -36,13 +37,14 @@ void init_timer1()
 #define F_TIMER2 1000
 void init_milli_counter_timer()
 {
-	// Configure timer 0 as fast PWM stopping at OCR0A (CTC should work as well)
-	TCCR2A |= (1<<WGM00) | (1<<WGM01);
+	// Configure timer 2 as CTC stopping at OCR2A. Unlike fast PWM, OCR2B isn't
+	// double buffered, so the KCS pulse bursts can move compare B within a period
+	TCCR2A |= (1<<WGM21);
 
 	// Select highest prescaler where 256 steps take more than 1ms for given F_CPU:
 	// 1/F_CPU * 2^8 * Prescaler >= 1/1000 s => Prescaler >= F_CPU / 2^8 / 1000
-	//        fast PWM     Prescaler = 64 for F_CPU = 16000000
-	TCCR2B |= (1<<WGM02) | (1<<CS00) | (1<<CS01);
+	//        Prescaler = 64 for F_CPU = 16000000
+	TCCR2B |= (1<<CS20) | (1<<CS21);
 
 	// Select ticks after 1ms has passed:
 	// 1/F_CPU * ticks * Prescaler = 1/1000s => ticks = F_CPU / Prescaler / 1000
@@ -60,13 +62,13 @@ void init_midi_UART()
 	UBRR0H = BAUD_RATE_BYTES >> 8; // baud rate is uint16_t so it takes up two registers
 	UBRR0L = BAUD_RATE_BYTES;
 	
-	// Midi Tx pin:		UCSR0B |= (1 << TXEN0 ); // enable transmitter
+#ifdef ENABLE_MIDI_OUTPUT
+	UCSR0B |= (1 << TXEN0 ); // enable transmitter, takes over PD1 (see GPIO.h)
+#endif
 	UCSR0B |= (1 << RXEN0 ); // enable receiver
-	UCSR0B |= RX_COMPLETE_INTERRUPT; // enable Rx interrupt
+	UCSR0B |= RX_COMPLETE_INTERRUPT; // enable Rx interrupt, the Tx interrupt is enabled when there is data to send
 	
 	UCSR0C = (3 << UCSZ00 ); // Set for async operation, no parity, 1 stop bit, 8 data bits
-	
-	// Midi Tx pin:		DDRD |= _BV(PORTD1);
 }
 
 // Initialize the SPI as master
@@ -97,6 +99,10 @@ void init_digital_inputs()
 	DDR_MODE_SW &= ~_BV(DD_MODE_SW);
 	DDR_SYNC_BTN &= ~_BV(DD_SYNC_BTN);
 	DDR_LEARN_SW &= ~_BV(DD_LEARN_SW);
+	
+	PCMSK1 |= SWITCH_PCMSK1;
+	PCMSK2 |= SWITCH_PCMSK2;
+	PCICR |= SWITCH_PCICR;
 }
 
 void init_led_outputs()
@@ -111,6 +117,7 @@ void hardware_init()
 	init_led_outputs();
 	init_digital_outputs();
 	init_digital_inputs();
+	TRACE_INIT();
 	init_midi_UART();
 	init_DAC_SPI();
 	
@@ -15,6 +15,17 @@
 #define F_CPU 16000000UL
 #endif
 
+/* MIDI out uses the USART Tx pin, PD1, which is LED B's red line on the
+   current board. With this defined PD1 carries MIDI and ledb_red() has no
+   visible effect, so only enable it on units wired for a MIDI out jack. */
+//#define ENABLE_MIDI_OUTPUT 1
+
+/* time every ISR and count Rx overruns, see IsrProfile.h */
+//#define ENABLE_ISR_PROFILE 1
+
+/* drive the TRACE PINS below while code regions run, see Trace.h */
+//#define ENABLE_TRACE 1
+
 #define USART_BAUD_RATE 31250 // MIDI Baud Rate
 #define BAUD_RATE_BYTES (((F_CPU / (USART_BAUD_RATE * 16UL))) - 1)
 
@@ -58,8 +69,48 @@
 #define LEARN_SW_PIN	PINC
 #define LEARN_SW		PINC5
 
+/* pin change interrupts on the switches, only used to wake the main loop */
+#define SWITCH_PCICR	(_BV(PCIE1) | _BV(PCIE2))
+#define SWITCH_PCMSK1	(_BV(PCINT12) | _BV(PCINT13))	/* sync PC4, learn PC5 */
+#define SWITCH_PCMSK2	_BV(PCINT23)					/* mode PD7 */
 
 
+
+/************************************************************************/
+/*     TRACE PINS (ENABLE_TRACE): high while the region runs            */
+/************************************************************************/
+/* PB1 is the only spare pin, the other regions borrow LED lines: the
+   LEDs show the trace instead of their usual colors in a trace build. */
+#define TRACE_PARSE_DDR			DDRB	/* MidiController::read_midi */
+#define TRACE_PARSE_PORT		PORTB
+#define TRACE_PARSE_BIT			PORTB1
+
+#define TRACE_DISPATCH_DDR		DDRC	/* MIDI and SysEx handlers, LED A green */
+#define TRACE_DISPATCH_PORT		PORTC
+#define TRACE_DISPATCH_BIT		PORTC2
+
+#define TRACE_DAC_DDR			DDRC	/* CvOutput::output_dac, LED A red */
+#define TRACE_DAC_PORT			PORTC
+#define TRACE_DAC_BIT			PORTC3
+
+#define TRACE_EEPROM_DDR		DDRC	/* save_config & save_note_offsets, LED C green */
+#define TRACE_EEPROM_PORT		PORTC
+#define TRACE_EEPROM_BIT		PORTC1
+
+
+
+/************************************************************************/
+/*     CALIBRATION INPUTS: V/oct outputs fed back into ADC6 & ADC7      */
+/************************************************************************/
+/* The V/oct outputs must be patched to the ADC pins through a divider
+   (CAL_ADC_DIVIDER = Vout / Vadc) so that the top of the range stays
+   below CAL_ADC_REF_MV. Measure AVcc once and set CAL_ADC_REF_MV to it,
+   the accuracy of the calibration can be no better than this number. */
+#define CAL_ADC_CH_A		6
+#define CAL_ADC_CH_B		7
+#define CAL_ADC_REF_MV		5000.0
+#define CAL_ADC_DIVIDER		2.0
+
 /************************************************************************/
 /*     SPI Output: MOSI, SCK, CS  -->  DAC                              */
 /************************************************************************/
@@ -116,6 +167,14 @@
 #define ENABLE_OCI1B()    (TIMSK1 |= (1 << OCIE1B))
 #define DISABLE_OCI1B()   (TIMSK1 &= ~(1 << OCIE1B))
 
+// Macros to enable and disable the Timer2 Output Compare B Match Interrupt (KCS pulse bursts)
+#define ENABLE_OCI2B()    (TIMSK2 |= (1 << OCIE2B))
+#define DISABLE_OCI2B()   (TIMSK2 &= ~(1 << OCIE2B))
+
+// Macros to enable and disable the Timer0 Overflow Interrupt (VEL dithering, every PWM period)
+#define ENABLE_TOI0()     (TIMSK0 |= (1 << TOIE0))
+#define DISABLE_TOI0()    (TIMSK0 &= ~(1 << TOIE0))
+
 #define leda_green()	set_bit(LED_A_PORT, LED_A_G);\
 						clear_bit(LED_A_PORT, LED_A_R);
 #define leda_red()		set_bit(LED_A_PORT, LED_A_R);\
@@ -0,0 +1,59 @@
+/*
+ * Histogram.h
+ *
+ * Fixed-bucket timing histogram. Bucket 0 counts times under 4us (one
+ * Timer2 tick) and bucket n times of 2^(n-1) to 2^n ticks, so 16 buckets
+ * cover up to ~131ms; longer times land in the last one. Counts stop at
+ * UINT16_MAX rather than wrap.
+ */ 
+
+
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stdint.h>
+
+#define HIST_BUCKETS 16
+
+enum HistogramId
+{
+	HistRxWait,			/* last byte of a message received -> dispatched */
+	HistHandler,		/* parsing and handling one message */
+	HistDacInterval,	/* between two writes to the same DAC channel */
+	NUM_HISTOGRAMS
+};
+
+class Histogram
+{
+public:
+	uint16_t counts[HIST_BUCKETS];
+
+public:
+	Histogram() { clear(); }
+	
+	void add(uint32_t us)
+	{
+		uint16_t ticks = us > UINT16_MAX * 4UL ? UINT16_MAX : us >> 2;
+		uint8_t bucket = 0;
+		while (ticks && bucket < HIST_BUCKETS - 1)
+		{
+			ticks >>= 1;
+			bucket++;
+		}
+		
+		if (counts[bucket] < UINT16_MAX)
+		{
+			counts[bucket]++;
+		}
+	}
+	
+	void clear()
+	{
+		for (uint8_t i = 0; i < HIST_BUCKETS; i++)
+		{
+			counts[i] = 0;
+		}
+	}
+};
+
+#endif /* HISTOGRAM_H_ */
@@ -0,0 +1,31 @@
+/*
+ * IsrProfile.cpp
+ *
+ * Counters for the ISR profiling build, see IsrProfile.h.
+ */ 
+
+#include <util/atomic.h>
+
+#include "IsrProfile.h"
+
+#ifdef ENABLE_ISR_PROFILE
+
+IsrStats isr_stats[NUM_PROFILED_ISRS];
+uint16_t rx_overruns;
+
+void isr_profile_clear()
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for (uint8_t i = 0; i < NUM_PROFILED_ISRS; i++)
+		{
+			isr_stats[i].min_ticks = UINT16_MAX;
+			isr_stats[i].max_ticks = 0;
+			isr_stats[i].total_ticks = 0;
+			isr_stats[i].count = 0;
+		}
+		rx_overruns = 0;
+	}
+}
+
+#endif /* ENABLE_ISR_PROFILE */
@@ -0,0 +1,79 @@
+/*
+ * IsrProfile.h
+ *
+ * Optional ISR profiling (define ENABLE_ISR_PROFILE in GPIO.h). Each
+ * profiled ISR stamps TCNT1 on entry and exit and keeps min/max/total
+ * run time in 4us Timer1 ticks. Timer1 is free running (only its compare
+ * units are used, for the trigger pulses) so the stamps cost two register
+ * reads. Single runs are only resolved to a tick, the average over many
+ * runs is finer. The Rx ISR also counts USART data overruns, which is
+ * what happens when the other ISRs keep it waiting too long.
+ *
+ * With ENABLE_ISR_PROFILE undefined the macros are empty.
+ */ 
+
+
+#ifndef ISRPROFILE_H_
+#define ISRPROFILE_H_
+
+#include <avr/io.h>
+#include <stdint.h>
+
+#include "GPIO.h"
+
+enum IsrId
+{
+	IsrUsartRx,
+	IsrUsartUdre,
+	IsrTimer2CompA,
+	IsrTimer1CompA,
+	IsrTimer1CompB,
+	IsrTimer2CompB,
+	IsrTimer0Ovf,		/* the dithering runs only, not the periods it counts down */
+	NUM_PROFILED_ISRS
+};
+
+#ifdef ENABLE_ISR_PROFILE
+
+struct IsrStats
+{
+	uint16_t min_ticks;
+	uint16_t max_ticks;
+	uint32_t total_ticks;
+	uint16_t count;
+};
+
+extern IsrStats isr_stats[NUM_PROFILED_ISRS];
+extern uint16_t rx_overruns;
+
+/* only called from ISRs, so nothing here can be interrupted */
+inline void isr_profile_record(uint8_t id, uint16_t ticks)
+{
+	IsrStats& s = isr_stats[id];
+	if (ticks < s.min_ticks)
+		s.min_ticks = ticks;
+	if (ticks > s.max_ticks)
+		s.max_ticks = ticks;
+	
+	if (s.count < UINT16_MAX)
+	{
+		s.total_ticks += ticks;
+		s.count++;
+	}
+}
+
+void isr_profile_clear();
+
+#define ISR_PROFILE_BEGIN()		uint16_t isr_profile_start = TCNT1
+#define ISR_PROFILE_END(id)		isr_profile_record(id, TCNT1 - isr_profile_start)
+#define ISR_PROFILE_RX_OVERRUN()	do { if (bit_is_set(UCSR0A, DOR0)) rx_overruns++; } while (0)
+
+#else
+
+#define ISR_PROFILE_BEGIN()
+#define ISR_PROFILE_END(id)
+#define ISR_PROFILE_RX_OVERRUN()
+
+#endif /* ENABLE_ISR_PROFILE */
+
+#endif /* ISRPROFILE_H_ */
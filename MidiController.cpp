@@ -7,14 +7,15 @@
 #include <avr/io.h>
 #include <util/atomic.h>
 #include <math.h>
+#include <string.h>
 #include <avr/interrupt.h>
 #include <avr/cpufunc.h>
 
 #include "GPIO.h"
 #include "MidiController.h"
 #include "lib/MIDI.h"
+#include "Trace.h"
 
-#define SWITCH_DEBOUNCE_DUR 20  // count of Timer1 interrupts b
 #define MAX_ADV_LENGTH 1000 // millis
 
 #define KCS_MODE !switch_state
@@ -45,11 +46,12 @@ MidiController::MidiController():
 	midi((SMT&) transport)
 {
 	last_clock = 0;
+	transport.thru_settings = &settings.thru;
 	
 	/*  A settings  */
 	cv_out_a.settings.retrig_mode = RetrigOff;
 	cv_out_a.settings.trigger_duration_ms = 10;
-	cv_out_a.settings.portamento_on = false;
+	cv_out_a.settings.portamento_on = PortamentoOff;
 	cv_out_a.settings.portamento_time_asc_user = 100;
 	cv_out_a.settings.portamento_time_desc_user = 100;
 	
@@ -62,19 +64,26 @@ MidiController::MidiController():
 	cv_out_b.settings.vib_depth_cents = 0;
 	
 	cv_out_b.settings.vib_mode = Free;
-	cv_out_b.settings.portamento_on = true;
+	cv_out_b.settings.portamento_on = PortamentoOn;
 	cv_out_b.settings.portamento_time_asc_user = 2000;
 	cv_out_b.settings.portamento_time_desc_user = 2000;
 	
 	millis_last = 0;
-	last_sw_read = 0;
 	
 	follow_midi_clock = false;
 	clock_count = 0;
 	cur_dfam_step = 0; // the number of the last DFAM step triggered
+	adv_burst_left = 0;
+	adv_gap_ticks = 0;
+	dfam_step = 0;
 	switch_state = -1;
 	
 	time_counter = 0;
+	time_seq = 0;
+	tick_ms = 0;
+	tick_us = 0;
+	
+	build_step_table();
 }
 
 void MidiController::update_midi_channels(uint8_t* ch)
@@ -100,41 +109,266 @@ void MidiController::update_keyboard_prefs(uint8_t* key_prefs)
 	{
 		settings.keyboard_step_table[i] = key_prefs[i];
 	}
+	build_step_table();
+}
+
+/*
+	valid - the channels are 1-16, the enums in range, the clock division
+		one of DIVISIONS (handleClock divides PPQN by it) and the KCS pulse
+		period within KCS_PULSE_PERIOD_MIN_US..KCS_PULSE_PERIOD_MAX_US
+*/
+bool MctlSettings::valid() const
+{
+	const uint8_t channels[3] = {midi_ch_A, midi_ch_B, midi_ch_KCS};
+	for (uint8_t i = 0; i < 3; i++)
+	{
+		if (channels[i] < 1 || channels[i] > 16)
+		{
+			return false;
+		}
+	}
+	
+	bool div_ok = false;
+	for (uint8_t i = 0; i < NUM_DIVISIONS; i++)
+	{
+		div_ok |= clock_div == DIVISIONS[i];
+	}
+	
+	return div_ok
+		&& midi_mode <= Poly
+		&& thru.mode <= ThruFiltered
+		&& kcs_layout <= KcsOctaveWrap
+		&& kcs_pulse_period_us >= KCS_PULSE_PERIOD_MIN_US
+		&& kcs_pulse_period_us <= KCS_PULSE_PERIOD_MAX_US;
+}
+
+/*
+	build_step_table - expands keyboard_step_table into NOTE_STEP_TABLE so a KCS
+		NoteOn finds its step with one load. Call again whenever the keyboard
+		prefs or the layout change. If a note is learned for more than one step
+		the lowest step wins, and a learned note beats another step's octave.
+		Steps fit in a nibble, so even notes go in the low half of each byte.
+*/
+void MidiController::build_step_table()
+{
+	memset(note_step_table, 0, sizeof(note_step_table));
+	
+	if (settings.kcs_layout == KcsOctaveWrap)
+	{
+		for (uint8_t step = DFAM_STEPS; step > 0; step--)
+		{
+			for (uint8_t note = settings.keyboard_step_table[step - 1] % 12; note < 128; note += 12)
+			{
+				set_note_step(note, step);
+			}
+		}
+	}
+	
+	for (uint8_t step = DFAM_STEPS; step > 0; step--)
+	{
+		uint8_t note = settings.keyboard_step_table[step - 1];
+		if (note < 128)
+		{
+			set_note_step(note, step);
+		}
+	}
+}
+
+void MidiController::set_note_step(uint8_t note, uint8_t step)
+{
+	uint8_t& pair = note_step_table[note >> 1];
+	pair = note & 1 ? (pair & 0x0F) | (step << 4) : (pair & 0xF0) | step;
 }
 
 void MidiController::time_inc()
 {
+	time_seq++;
 	time_counter++;
 }
 
-uint32_t MidiController::millis()
+/*
+	read_time - reads the millisecond count and the Timer2 ticks (4us) into it
+		without turning interrupts off: if the Timer2 interrupt ran in the
+		middle the sequence number changed and the read is done again
+*/
+void MidiController::read_time(uint32_t* ms, uint8_t* ticks)
 {
-	uint32_t tms;
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	uint8_t seq;
+	do
+	{
+		seq = time_seq;
+		*ms = time_counter;
+		*ticks = TCNT2;
+		
+		// with interrupts off (in an ISR) a compare match may not have been counted yet.
+		// It may also have happened just after TCNT2 was read: the ticks are read again
+		// so they're past the match too, not near TOP of the millisecond counted here
+		if (bit_is_set(TIFR2, OCF2A) && bit_is_clear(SREG, SREG_I))
+		{
+			*ticks = TCNT2;
+			(*ms)++;
+		}
+	} while (seq != time_seq);
+	
+	// the millisecond ends on the compare match at TOP: the tick at TOP starts the next one
+	(*ticks)++;
+	if (*ticks > OCR2A)
+	{
+		*ticks = 0;
+	}
+}
+
+/*
+	sample_time - takes the time everything done until the next call sees
+		(see now_ms/now_us) and returns it as a byte stamp
+*/
+uint16_t MidiController::sample_time()
+{
+	uint8_t ticks;
+	read_time(&tick_ms, &ticks);
+	tick_us = tick_ms * 1000 + ticks * TIME_TICK_US;
+	return stamp(tick_ms, ticks);
+}
+
+/*
+	read_midi - parses the received bytes that are at least RX_LATENCY_US old
+*/
+void MidiController::read_midi()
+{
+	uint16_t now = sample_time();
+	transport.release_stamp = now - RX_LATENCY_US / TIME_TICK_US;
+	
+	TRACE_BEGIN(PARSE);
+	bool handled = midi.read();
+	TRACE_END(PARSE);
+	
+	if (handled)
 	{
-		tms = time_counter;
+		// a message was completed by the byte just read and has been handled
+		histograms[HistRxWait].add((uint16_t) (now - transport.latest_stamp) * (uint32_t) TIME_TICK_US);
+		histograms[HistHandler].add(micros() - tick_us);
 	}
-	return tms;
 }
 
-void MidiController::update()
+/*
+	write_midi - carries on with a long SysEx reply as the tx queue empties
+*/
+void MidiController::write_midi()
 {
-	// check the MIDI Tx buffer and deal with any new messages.
-	midi.read();
+	transport.pumpSysEx();
+}
 
-	// update V/oct outputs based on slide and/or vibrato progress
+/*
+	update_outputs - moves the V/oct outputs on with their slide and vibrato
+		and the VEL outputs towards their modulation. The modulation matrix
+		they read is worked out by the Timer2 tick (see ModMatrix).
+*/
+void MidiController::update_outputs()
+{
+	sample_time();
 	cv_out_a.slide_progress();
 	cv_out_b.slide_progress();
+	cv_out_a.update_velocity();
+	cv_out_b.update_velocity();
+}
+
+/*
+	update_dither - the Timer0 overflow interrupt only runs while a VEL
+		output is dithering
+*/
+void MidiController::update_dither()
+{
+	if (cv_out_a.vel_dithering || cv_out_b.vel_dithering)
+	{
+		ENABLE_TOI0();
+	}
+	else
+	{
+		DISABLE_TOI0();
+	}
+}
+
+/*
+	update_switches - reads the mode switch and sync button. Called every
+		20ms or so, which also debounces them.
+*/
+void MidiController::update_switches()
+{
+	check_mode_switch();
+	check_sync_switch();
+}
+
+/*
+	midi_pending - whether read_midi has bytes it can parse right away
+*/
+bool MidiController::midi_pending()
+{
+	return transport.available();
+}
+
+/*
+	midi_buffered - whether any received byte is still waiting, released or
+		not. Nothing wakes the CPU when a byte turns RX_LATENCY_US old, so the
+		loop mustn't sleep while this is true.
+*/
+bool MidiController::midi_buffered()
+{
+	return transport.midi_rx_buffer.ready();
+}
+
+template <typename T, uint8_t N>
+static uint8_t put_buffer_stats(uint8_t* msg, CircularBuffer<T, N>& buf, bool clear)
+{
+	msg[0] = buf.peak;
+	msg[1] = N - 1; // one slot always stays empty
+	msg[2] = buf.drops & 0xFF;
+	msg[3] = buf.drops >> 8;
 	
-	// read the hardware inputs (the two switches)
-	if (millis() - last_sw_read >= SWITCH_DEBOUNCE_DUR)
+	if (clear)
+		buf.clear_stats();
+	return 4;
+}
+
+/*
+	buffer_stats - writes <peak> <capacity> <drops> for each ring buffer into
+		MSG (see SysexBufferStatsRequest) and returns the number of bytes
+*/
+uint8_t MidiController::buffer_stats(uint8_t* msg, bool clear)
+{
+	uint8_t len = 0;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		check_mode_switch();
-		check_sync_switch();
-		last_sw_read = millis();
+		len += put_buffer_stats(msg + len, transport.midi_rx_buffer, clear);
+		len += put_buffer_stats(msg + len, transport.midi_tx_buffer, clear);
 	}
+	len += put_buffer_stats(msg + len, cv_out_a.latest_notes, clear);
+	len += put_buffer_stats(msg + len, cv_out_b.latest_notes, clear);
+	len += put_buffer_stats(msg + len, clock_period_buffer, clear);
+	return len;
 }
 
+uint32_t MidiController::millis()
+{
+	uint32_t ms;
+	uint8_t ticks;
+	read_time(&ms, &ticks);
+	return ms;
+}
+
+/*
+	micros - time in microseconds, 4us resolution. Wraps after ~71 minutes
+		so only use it for differences.
+*/
+uint32_t MidiController::micros()
+{
+	uint32_t ms;
+	uint8_t ticks;
+	read_time(&ms, &ticks);
+	return ms * 1000 + ticks * TIME_TICK_US;
+}
+
+
 void MidiController::tx_ready()
 {
 /*
@@ -146,11 +380,39 @@ void MidiController::tx_ready()
 	{
 		UDR0 = midi_byte;
 	}
+	else
+	{
+		// nothing left to send: the next SMT::write turns the interrupt back on
+		UCSR0B &= ~DATA_REGISTER_EMPTY_INTERRUPT;
+	}
 }
 
 uint8_t MidiController::incoming_message(uint8_t msg)
 {
-	return transport.midi_rx_buffer.put(msg);
+#ifdef ENABLE_MIDI_OUTPUT
+	transport.thru(msg);
+#endif
+	
+	// stamped here rather than when it's read, so the time doesn't depend on the main loop
+	uint32_t ms;
+	uint8_t ticks;
+	read_time(&ms, &ticks);
+	return transport.midi_rx_buffer.put({msg, stamp(ms, ticks)});
+}
+
+void MidiController::setHandleSysEx(SysexReceiver::Sink sink, SysexReceiver::Callback cb)
+{
+	transport.sysex.setHandlers(sink, cb);
+}
+
+void MidiController::send_sysex(uint8_t command, const uint8_t* data, uint8_t size)
+{
+	transport.writeSysEx(command, data, size);
+}
+
+void MidiController::send_sysex(uint8_t command, uint8_t tag, SysexSource source, uint8_t size)
+{
+	transport.writeSysEx(command, tag, source, size);
 }
 
 /************************************************************************/
@@ -158,11 +420,19 @@ uint8_t MidiController::incoming_message(uint8_t msg)
 /************************************************************************/
 
 /*
-	advance_clock - sends a single pulse on the ADV/CLOCK output
+	advance_clock - sends a single pulse on the ADV/CLOCK output. If a burst
+		is going the pulse is added to it instead, so the two can't merge.
 */
 void MidiController::advance_clock()
 {
+	if (adv_burst_busy())
+	{
+		advance_clock(1);
+		return;
+	}
+	
 	set_bit(ADV_PORT, ADV_OUT);
+	dfam_step = dfam_step % NUM_STEPS + 1;
 	
 	for (int i = 0; i < settings.adv_clock_ticks; i++)
 	{
@@ -173,17 +443,81 @@ void MidiController::advance_clock()
 	clear_bit(ADV_PORT, ADV_OUT);
 }
 
+/* the gap is kept in a uint8_t, and adv_burst_edge can only wrap OCR2B once */
+static_assert((KCS_PULSE_PERIOD_MAX_US - ADV_PULSE_WIDTH_US) / TIME_TICK_US <= UINT8_MAX,
+	"KCS pulse gap doesn't fit adv_gap_ticks");
+static_assert((KCS_PULSE_PERIOD_MAX_US - ADV_PULSE_WIDTH_US) / TIME_TICK_US < 1000 / TIME_TICK_US,
+	"KCS pulse gap is longer than a Timer2 period");
+static_assert(ADV_PULSE_WIDTH_US / TIME_TICK_US < 1000 / TIME_TICK_US,
+	"ADV pulse is longer than a Timer2 period");
+
 /*
-	advance_clock - sends a number of pulses on the ADV/CLOCK output
+	advance_clock - queues a number of pulses on the ADV/CLOCK output. They
+		are sent from the Timer2 compare B interrupt, ADV_PULSE_WIDTH_US
+		wide and no closer than kcs_pulse_period_us, so a jump neither
+		blocks the loop nor sends pulses faster than the DFAM counts them.
+		With no burst going the first pulse starts right away.
+		The model is open loop: nothing reads the DFAM's step back, so
+		cur_dfam_step and dfam_step only count pulses sent. A pulse the
+		DFAM misses goes unnoticed until the sync button resets both.
 */
 void MidiController::advance_clock(uint8_t steps)
 {
-	for (int i = 0; i < steps; i++)
+	if (!steps)
 	{
-		advance_clock();
+		return;
+	}
+	
+	uint16_t period = in_range(settings.kcs_pulse_period_us, KCS_PULSE_PERIOD_MIN_US, KCS_PULSE_PERIOD_MAX_US);
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		adv_gap_ticks = (period - ADV_PULSE_WIDTH_US) / TIME_TICK_US;
+		adv_burst_left += steps;
+		if (!adv_burst_busy())
+		{
+			adv_burst_edge();
+			TIFR2 = (1 << OCF2B); // a stale match would end the first pulse early
+			ENABLE_OCI2B();
+		}
 	}
 }
 
+/*
+	adv_burst_edge - the next edge of a pulse burst, from the Timer2 compare B
+		interrupt. After the last pulse the gap is still waited out, so a
+		burst queued right after this one can't come too soon.
+*/
+void MidiController::adv_burst_edge()
+{
+	uint8_t ticks;
+	if (bit_is_set(ADV_PORT, ADV_OUT))
+	{
+		clear_bit(ADV_PORT, ADV_OUT);
+		ticks = adv_gap_ticks;
+	}
+	else if (adv_burst_left)
+	{
+		set_bit(ADV_PORT, ADV_OUT);
+		adv_burst_left--;
+		dfam_step = dfam_step % NUM_STEPS + 1;
+		ticks = ADV_PULSE_WIDTH_US / TIME_TICK_US;
+	}
+	else
+	{
+		DISABLE_OCI2B();
+		return;
+	}
+	
+	// Timer2 counts 0..OCR2A every ms, the next edge may be in the next period
+	uint16_t next = TCNT2 + ticks;
+	if (next > OCR2A)
+	{
+		next -= OCR2A + 1;
+	}
+	OCR2B = next;
+}
+
 /*
 check_mode_switch -
 There are two modes: CCS (clock-controlled sequencer) or KCS (keyboard-controlled
@@ -239,6 +573,8 @@ void MidiController::check_sync_switch()
 	if (!bit_is_set(SYNC_BTN_PIN, SYNC_BTN))
 	{
 		cur_dfam_step = 1;
+		adv_burst_left = 0;
+		dfam_step = 1;
 	}
 }
 
@@ -248,6 +584,9 @@ void MidiController::check_sync_switch()
 
 #define CC_AdvClockWidth  MIDI_NAMESPACE::GeneralPurposeController7
 #define CC_ClockDiv		  MIDI_NAMESPACE::GeneralPurposeController8
+#define CC_ThruMode		  85 /* undefined: 0-42 off, 43-85 everything, 86-127 filtered */
+#define CC_KcsLayout	  89 /* undefined: 0-63 learned notes only, 64-127 any octave of them */
+#define CC_KcsPulseRate	  90 /* undefined: 0 = one pulse per ms ... 127 = one per 200us */
 
 void MidiController::handleCC(byte channel, byte cc_num, byte cc_val)
 {
@@ -268,6 +607,24 @@ void MidiController::handleCC(byte channel, byte cc_num, byte cc_val)
 			settings.clock_div = DIVISIONS[(uint8_t) (cc_val * NUM_DIVISIONS / 127.0)];
 			break;
 		
+		case CC_ThruMode:
+			settings.thru.mode = static_cast<ThruMode>(cc_val / 43);
+			break;
+		
+		case CC_KcsPulseRate:
+			settings.kcs_pulse_period_us = KCS_PULSE_PERIOD_MAX_US
+				- (uint32_t) cc_val * (KCS_PULSE_PERIOD_MAX_US - KCS_PULSE_PERIOD_MIN_US) / 127;
+			break;
+		
+		case CC_KcsLayout:
+			settings.kcs_layout = cc_val > 63 ? KcsOctaveWrap : KcsExact;
+			build_step_table();
+			break;
+		
+		case MIDI_NAMESPACE::ModulationWheel:
+			mod.set_source(ModSrcModWheel, cc_val);
+			break;
+		
 		case MIDI_NAMESPACE::OmniModeOff:
 			break;
 		
@@ -297,6 +654,9 @@ void MidiController::handleCC(byte channel, byte cc_num, byte cc_val)
 
 void MidiController::handleNoteOn(uint8_t channel, uint8_t midi_note, uint8_t velocity)
 {
+	if (channel == settings.midi_ch_A || channel == settings.midi_ch_B)
+		mod.set_source(ModSrcVelocity, velocity);
+	
 	if (settings.midi_mode == Poly && channel == settings.midi_ch_A)
 	{
 		if (cv_out_a.latest() == -1) 
@@ -326,12 +686,12 @@ void MidiController::handleNoteOn(uint8_t channel, uint8_t midi_note, uint8_t ve
 
 	if (channel == settings.midi_ch_KCS && KCS_MODE)
 	{
-		uint8_t dfam_step = midi_note_to_step(midi_note);
-		if (dfam_step) {
-			VEL_B_DUTY = velocity << 1;
-			int steps_left = steps_between(cur_dfam_step, dfam_step) + 1;
+		uint8_t step = midi_note_to_step(midi_note);
+		if (step) {
+			cv_out_b.set_vel_level((uint16_t) cv_out_b.velocity_duty(velocity) << 8);
+			int steps_left = steps_between(cur_dfam_step, step) + 1;
 			advance_clock(steps_left);
-			cur_dfam_step = dfam_step;
+			cur_dfam_step = step;
 		}
 	}
 }
@@ -424,6 +784,9 @@ void MidiController::handleContinue()
 */
 void MidiController::handlePitchBend(byte midi_ch, int16_t amt)
 {
+	if (midi_ch == settings.midi_ch_A || midi_ch == settings.midi_ch_B)
+		mod.set_pitch_bend(amt);
+	
 	if (midi_ch == settings.midi_ch_A)
 		cv_out_a.pitch_bend(amt);
 	
@@ -431,6 +794,27 @@ void MidiController::handlePitchBend(byte midi_ch, int16_t amt)
 		cv_out_b.pitch_bend(amt);
 }
 
+void MidiController::handleAfterTouchChannel(byte midi_ch, byte pressure)
+{
+	if (midi_ch == settings.midi_ch_A || midi_ch == settings.midi_ch_B)
+		mod.set_source(ModSrcPressure, pressure);
+	
+	if (midi_ch == settings.midi_ch_A)
+		cv_out_a.modulation(VelSrcPressure, pressure);
+	
+	if (midi_ch == settings.midi_ch_B)
+		cv_out_b.modulation(VelSrcPressure, pressure);
+}
+
+void MidiController::handleAfterTouchPoly(byte midi_ch, byte note, byte pressure)
+{
+	if (midi_ch == settings.midi_ch_A)
+		cv_out_a.poly_pressure(note, pressure);
+	
+	if (midi_ch == settings.midi_ch_B)
+		cv_out_b.poly_pressure(note, pressure);
+}
+
 /************************************************************************/
 /*		HELPER METHODS                                                  */
 /************************************************************************/
@@ -456,10 +840,7 @@ uint8_t MidiController::steps_between(int start, int end)
 		many steps to advance to get to the chosen note
 */
 uint8_t MidiController::midi_note_to_step(uint8_t note) {
-	for (int i = 0; i < NUM_STEPS; i++) {
-		if (note == settings.keyboard_step_table[i])
-			return i + 1;
-	}
-	return false;
+	uint8_t pair = note_step_table[(note & 0x7F) >> 1];
+	return note & 1 ? pair >> 4 : pair & 0x0F;
 }
 
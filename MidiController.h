@@ -25,12 +25,32 @@
 #include "CircularBuffer.h"
 #include "CvOutput.h"
 #include "Serializable.h"
+#include "Histogram.h"
+#include "ModMatrix.h"
 
-typedef MIDI_NAMESPACE::MidiInterface<MIDI_NAMESPACE::SerialMidiTransport> MidiInterface;
+/* SysEx is decoded by the transport (see Sysex.h), the library never sees it */
+struct MidiSettings : public MIDI_NAMESPACE::DefaultSettings
+{
+	static const unsigned SysExMaxSize = 4;
+};
+
+typedef MIDI_NAMESPACE::MidiInterface<MIDI_NAMESPACE::SerialMidiTransport, MidiSettings> MidiInterface;
 
 #define BPM_BUFFER_SIZE 12
+
+/* received bytes are handled this long after they arrived (see SMT::available).
+   Longer than a pass of the main loop so the delay is the same for every message. */
+#define RX_LATENCY_US 1000
+#define TIME_TICK_US 4
 #define DFAM_STEPS 8
+
+/* KCS jumps are sent as bursts of ADV pulses this wide, at most one every
+   kcs_pulse_period_us. The period has to fit in one Timer2 period (1ms). */
+#define ADV_PULSE_WIDTH_US 100
+#define KCS_PULSE_PERIOD_MIN_US 200
+#define KCS_PULSE_PERIOD_MAX_US 1000
 enum MidiMode { Mono, Poly };
+enum KcsLayout { KcsExact, KcsOctaveWrap }; /* octave wrap: every octave of a step's note plays it */
 
 class MctlSettings : public Serializable
 {
@@ -47,49 +67,31 @@ public:
     uint8_t keyboard_step_table[DFAM_STEPS]; /* val => midi_note number,
 												idx => DFAM sequence step to trigger */
 
-    MctlSettings() : keyboard_step_table{48, 50, 52, 53, 55, 57, 59, 60}
-    { }
-
-    void serialize(uint8_t* buffer) const override
-    {
-        size_t offset = 0;
-
-        buffer[offset++] = (MidiMode) midi_mode;
-        buffer[offset++] = midi_ch_A;
-        buffer[offset++] = midi_ch_B;
-        buffer[offset++] = midi_ch_KCS;
-        buffer[offset++] = clock_div;
-        buffer[offset++] = adv_clock_ticks;
+    ThruSettings thru; /* hardware MIDI thru, by default everything but the KCS channel */
+    KcsLayout kcs_layout = KcsExact;
+    uint16_t kcs_pulse_period_us = 500; /* fastest rate the DFAM is sent jump pulses at */
 
-        memcpy(buffer + offset, keyboard_step_table, sizeof(keyboard_step_table));
-        offset += sizeof(keyboard_step_table);
-    }
+    MctlSettings() : keyboard_step_table{48, 50, 52, 53, 55, 57, 59, 60},
+                     thru{ThruOff, 0xFDFF, ThruAllTypes}
+    { }
 
-    void deserialize(const uint8_t* buffer) override
+    void walk(SerialCursor& c) override
     {
-        size_t offset = 0;
-
-        midi_mode = static_cast<MidiMode>(buffer[offset++]);
-        midi_ch_A = buffer[offset++];
-        midi_ch_B = buffer[offset++];
-        midi_ch_KCS = buffer[offset++];
-        clock_div = buffer[offset++];
-        adv_clock_ticks = buffer[offset++];
-
-        memcpy(keyboard_step_table, buffer + offset, sizeof(keyboard_step_table));
-        offset += sizeof(keyboard_step_table);
+        c.field(&midi_mode, sizeof(midi_mode));
+        c.field(&midi_ch_A, sizeof(midi_ch_A));
+        c.field(&midi_ch_B, sizeof(midi_ch_B));
+        c.field(&midi_ch_KCS, sizeof(midi_ch_KCS));
+        c.field(&clock_div, sizeof(clock_div));
+        c.field(&adv_clock_ticks, sizeof(adv_clock_ticks));
+        c.field(keyboard_step_table, sizeof(keyboard_step_table));
+        c.field(&thru.mode, sizeof(thru.mode));
+        c.field(&thru.channels, sizeof(thru.channels));
+        c.field(&thru.types, sizeof(thru.types));
+        c.field(&kcs_layout, sizeof(kcs_layout));
+        c.field(&kcs_pulse_period_us, sizeof(kcs_pulse_period_us));
     }
 
-    size_t size_bytes() const override
-    {
-        return sizeof(midi_mode) +
-               sizeof(midi_ch_A) +
-               sizeof(midi_ch_B) +
-               sizeof(midi_ch_KCS) +
-               sizeof(clock_div) +
-               sizeof(adv_clock_ticks) +
-               sizeof(keyboard_step_table);
-    }
+    bool valid() const override;
 };
 
 class MidiController
@@ -103,27 +105,41 @@ private:
 	uint8_t follow_midi_clock;
 	uint8_t clock_count;
 	uint32_t last_clock;
-	uint8_t cur_dfam_step;
+	uint8_t cur_dfam_step;			/* where the DFAM will be once the queued pulses are out */
+	
+	/* ADV pulse bursts (see advance_clock(steps)) and the step each pulse sent moves the DFAM to */
+	volatile uint8_t adv_burst_left;
+	volatile uint8_t adv_gap_ticks;
+	volatile uint8_t dfam_step;
 	
-	volatile uint32_t last_sw_read;
 	volatile uint8_t switch_state;
 	volatile uint32_t time_counter;
+	volatile uint8_t time_seq;		/* bumped by every time_inc, see read_time */
+	uint32_t tick_ms;				/* time of the last sample_time() */
+	uint32_t tick_us;
 	CircularBuffer<float, BPM_BUFFER_SIZE> clock_period_buffer;
+	uint8_t note_step_table[64];	/* midi note => DFAM step (0 for none), two notes a byte, see build_step_table */
 
 public:
 	MctlSettings settings;
 	CvOutput cv_out_a;
 	CvOutput cv_out_b;
+	ModMatrix mod;
 	MidiInterface midi;
+	Histogram histograms[NUM_HISTOGRAMS]; /* see HistogramId */
 
 /***** METHODS *****/
 public:
 	MidiController();
 	float avg_midi_clock_period();
 	void init_event_handlers();
-	void update();
+	void update_outputs();
+	void update_switches();
 	uint8_t incoming_message(uint8_t);
 	void tx_ready();
+	void setHandleSysEx(SysexReceiver::Sink sink, SysexReceiver::Callback cb);
+	void send_sysex(uint8_t command, const uint8_t* data, uint8_t size);
+	void send_sysex(uint8_t command, uint8_t tag, SysexSource source, uint8_t size);
 	
 	// Event handlers
 	void handleCC(byte channel, byte cc_num, byte cc_val);
@@ -133,18 +149,36 @@ public:
 	void handleStop();
 	void handleClock();
 	void handleContinue();
-	void handlePitchBend(uint8_t ch, int amt);
+	void handlePitchBend(uint8_t ch, int16_t amt);
+	void handleAfterTouchChannel(uint8_t ch, uint8_t pressure);
+	void handleAfterTouchPoly(uint8_t ch, uint8_t note, uint8_t pressure);
+	
+	void read_midi();
+	void write_midi();
+	void update_dither();
+	bool midi_pending();
+	bool midi_buffered();
 	
 	void time_inc();
 	uint32_t millis();
+	uint32_t micros();
+	uint16_t message_stamp() const { return transport.latest_stamp; }
+	uint8_t buffer_stats(uint8_t* msg, bool clear);
+	uint32_t now_ms() const { return tick_ms; }
+	uint32_t now_us() const { return tick_us; }
 	
 	void update_midi_channels(uint8_t* channels);
 	void update_keyboard_prefs(uint8_t* channels);
+	void build_step_table();
 	void advance_to_beginning();
 	void advance_clock();
+	void adv_burst_edge();
+	uint8_t dfam_position() const { return dfam_step; }
+	bool adv_burst_busy() const { return bit_is_set(TIMSK2, OCIE2B); }
 	
 private:
 	void advance_clock(uint8_t steps);
+	void set_note_step(uint8_t note, uint8_t step);
 	
 	void vibrato_depth_cc(uint8_t cc_val);
 	
@@ -152,6 +186,10 @@ private:
 	void check_mode_switch();
 	void check_sync_switch();
 	
+	void read_time(uint32_t* ms, uint8_t* ticks);
+	static uint16_t stamp(uint32_t ms, uint8_t ticks) { return (uint16_t) ms * (1000 / TIME_TICK_US) + ticks; }
+	uint16_t sample_time();
+	
 	// Helper methods
 	static uint8_t steps_between(int start, int end);
 	uint8_t midi_note_to_step(uint8_t note);
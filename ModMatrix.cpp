@@ -0,0 +1,51 @@
+/*
+ * ModMatrix.cpp
+ *
+ * see ModMatrix.h
+ */
+
+#include "ModMatrix.h"
+
+/*
+	triangle - bipolar triangle over a 16-bit phase
+*/
+static int16_t triangle(uint16_t phase)
+{
+	uint16_t ramp = phase << 1;
+	if (phase & 0x8000)
+	{
+		ramp = ~ramp;
+	}
+	return (int16_t) (ramp ^ 0x8000);
+}
+
+/*
+	update - called every ms from the Timer2 interrupt: moves the LFOs on and works out every destination
+*/
+void ModMatrix::update()
+{
+	for (uint8_t i = 0; i < MOD_LFOS; i++)
+	{
+		lfo_phase[i] += (uint16_t) settings.lfo_rate[i] << 2;
+		sources[ModSrcLfo1 + i] = triangle(lfo_phase[i]);
+	}
+
+	int32_t sums[NUM_MOD_DESTS] = {};
+	for (uint8_t i = 0; i < MOD_SLOTS; i++)
+	{
+		const ModSlot& slot = settings.slots[i];
+		if (slot.dest == ModDstNone || slot.dest >= NUM_MOD_DESTS || slot.source >= NUM_MOD_SOURCES)
+		{
+			continue;
+		}
+		sums[slot.dest] += ((int32_t) sources[slot.source] * slot.amount) >> 7;
+	}
+
+	for (uint8_t d = 0; d < NUM_MOD_DESTS; d++)
+	{
+		int32_t sum = sums[d];
+		if (sum > INT16_MAX) sum = INT16_MAX;
+		if (sum < INT16_MIN) sum = INT16_MIN;
+		dests[d] = sum;
+	}
+}
@@ -0,0 +1,122 @@
+/*
+ * ModMatrix.h
+ *
+ * Small modulation matrix. Every source is kept as an int16 scaled to
+ * +-32767 (unipolar sources 0..32767), each of the MOD_SLOTS slots adds
+ * source * amount / 128 to its destination, and the sums are saturated
+ * back to int16. update() runs from the 1ms Timer2 interrupt, so the LFOs
+ * keep time however long the loop takes, the cost is MOD_SLOTS 16x8
+ * multiplies per ms whatever the settings, and the RAM is fixed by the
+ * sizes below. Unused slots have ModDstNone.
+ *
+ * Destinations are read by CvOutput (see ModDest for their scale) and
+ * only ever add to the settings, so an empty matrix changes nothing.
+ * Sources are set and destinations read from the loop, so both go
+ * through ATOMIC_BLOCK: an int16 takes two loads on the AVR.
+ */
+
+
+#ifndef MODMATRIX_H_
+#define MODMATRIX_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <util/atomic.h>
+
+#include "Serializable.h"
+
+#define MOD_SLOTS		8
+#define MOD_LFOS		2
+
+enum ModSource
+{
+	ModSrcLfo1,			/* triangles, bipolar */
+	ModSrcLfo2,
+	ModSrcVelocity,		/* of the last NoteOn on channel A or B */
+	ModSrcModWheel,
+	ModSrcPressure,		/* channel pressure */
+	ModSrcPitchBend,	/* bipolar */
+	NUM_MOD_SOURCES
+};
+
+enum ModDest
+{
+	ModDstNone,
+	ModDstPitchA,		/* full scale = +-1 octave */
+	ModDstPitchB,
+	ModDstVelA,			/* full scale = +-full VEL duty */
+	ModDstVelB,
+	ModDstVibDepth,		/* full scale = +-VIB_DEPTH_MAX cents */
+	ModDstVibRate,		/* full scale = period halved / 1.5 times longer */
+	ModDstGlideTime,	/* full scale = slide time doubled / zero */
+	NUM_MOD_DESTS
+};
+
+struct ModSlot
+{
+	ModSource source;
+	ModDest dest;
+	int8_t amount;		/* -128..127 = -100%..+99% */
+};
+
+class ModSettings : public Serializable
+{
+public:
+	ModSlot slots[MOD_SLOTS];
+	uint8_t lfo_rate[MOD_LFOS];	/* phase step per ms / 4: 1 -> 0.06Hz, 127 -> 7.75Hz */
+
+	ModSettings() : slots {}, lfo_rate {20, 50}
+	{	}
+
+	void walk(SerialCursor& c) override
+	{
+		c.field(slots, sizeof(slots));
+		c.field(lfo_rate, sizeof(lfo_rate));
+	}
+	
+	bool valid() const override
+	{
+		for (uint8_t i = 0; i < MOD_SLOTS; i++)
+		{
+			if (slots[i].source >= NUM_MOD_SOURCES || slots[i].dest >= NUM_MOD_DESTS)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+class ModMatrix
+{
+public:
+	ModSettings settings;
+	volatile int16_t sources[NUM_MOD_SOURCES];
+	volatile int16_t dests[NUM_MOD_DESTS];
+	uint16_t lfo_phase[MOD_LFOS];
+
+public:
+	ModMatrix() : sources {}, dests {}, lfo_phase {} {	}
+
+	/* VALUE is a MIDI data byte (0..127) */
+	void set_source(ModSource source, uint8_t value)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { sources[source] = (int16_t) value << 8; }
+	}
+	void set_pitch_bend(int16_t amt)
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { sources[ModSrcPitchBend] = amt << 2; }
+	}
+	int16_t value(ModDest dest) const
+	{
+		int16_t v;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { v = dests[dest]; }
+		return v;
+	}
+
+	void update();
+};
+
+
+#endif /* MODMATRIX_H_ */
@@ -0,0 +1,91 @@
+/*
+ * Scheduler.cpp
+ *
+ * See Scheduler.h. All times are 32-bit microseconds and only compared
+ * as differences, so the wrap of the clock every ~71 minutes is harmless.
+ */ 
+
+#include "Scheduler.h"
+
+Scheduler::Scheduler(Task* task_table, uint8_t num, uint32_t (*clock)())
+{
+	tasks = task_table;
+	num_tasks = num;
+	clock_us = clock;
+}
+
+/*
+	start - orders the table by priority and releases every task now
+*/
+void Scheduler::start()
+{
+	for (uint8_t i = 1; i < num_tasks; i++)
+	{
+		Task t = tasks[i];
+		uint8_t j = i;
+		for (; j > 0 && tasks[j - 1].priority > t.priority; j--)
+		{
+			tasks[j] = tasks[j - 1];
+		}
+		tasks[j] = t;
+	}
+	
+	uint32_t now = clock_us();
+	for (uint8_t i = 0; i < num_tasks; i++)
+	{
+		tasks[i].release_us = now;
+	}
+	clear_stats();
+}
+
+/*
+	run - one pass: runs every task that is due, in priority order. A periodic
+		task that has fallen more than a period behind is counted as a miss
+		and picks up from now instead of running several times to catch up.
+*/
+void Scheduler::run()
+{
+	for (uint8_t i = 0; i < num_tasks; i++)
+	{
+		Task& t = tasks[i];
+		uint32_t start = clock_us();
+		
+		if (t.period_us && (int32_t) (start - t.release_us) < 0)
+		{
+			continue; // not due yet
+		}
+		
+		uint32_t release = t.period_us ? t.release_us : start;
+		t.run();
+		uint32_t end = clock_us();
+		
+		uint32_t duration = end - start;
+		if (duration > t.wcet_us)
+		{
+			t.wcet_us = duration > UINT16_MAX ? UINT16_MAX : duration;
+		}
+		
+		if (end - release > t.deadline_us && t.misses < UINT16_MAX)
+		{
+			t.misses++;
+		}
+		
+		if (t.period_us)
+		{
+			t.release_us += t.period_us;
+			if ((int32_t) (end - t.release_us) >= 0)
+			{
+				t.release_us = end + t.period_us;
+			}
+		}
+	}
+}
+
+void Scheduler::clear_stats()
+{
+	for (uint8_t i = 0; i < num_tasks; i++)
+	{
+		tasks[i].wcet_us = 0;
+		tasks[i].misses = 0;
+	}
+}
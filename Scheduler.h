@@ -0,0 +1,53 @@
+/*
+ * Scheduler.h
+ *
+ * Cooperative scheduler for the main loop. Tasks live in a static table
+ * and run to completion, the highest priority first. Every run is timed
+ * so the worst case execution time and the number of missed deadlines of
+ * each task can be read back (see SysexTaskStatsRequest).
+ */ 
+
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdint.h>
+
+struct Task
+{
+	void (*run)();
+	uint16_t period_us;		/* 0: run on every pass of the loop */
+	uint16_t deadline_us;	/* allowed time from release to the end of the run */
+	uint8_t priority;		/* 0 runs first */
+	
+	/* kept up by the scheduler */
+	uint32_t release_us;
+	uint16_t wcet_us;
+	uint16_t misses;
+	
+	Task(void (*run)(), uint16_t period_us, uint16_t deadline_us, uint8_t priority)
+		: run(run), period_us(period_us), deadline_us(deadline_us), priority(priority),
+		  release_us(0), wcet_us(0), misses(0)
+	{	}
+};
+
+class Scheduler
+{
+
+/***** FIELDS *****/
+private:
+	Task* tasks;
+	uint8_t num_tasks;
+	uint32_t (*clock_us)();
+
+/***** METHODS *****/
+public:
+	Scheduler(Task* task_table, uint8_t num, uint32_t (*clock)());
+	void start();
+	void run();
+	void clear_stats();
+	uint8_t size() const { return num_tasks; }
+	const Task& task(uint8_t idx) const { return tasks[idx]; }
+};
+
+#endif /* SCHEDULER_H_ */
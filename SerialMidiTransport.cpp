@@ -6,6 +6,7 @@
 */
 
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 
 #include "lib/midi_Defs.h"
 #include "lib/midi_Namespace.h"
@@ -13,53 +14,470 @@
 #include "./GPIO.h"
 #include "SerialMidiTransport.h"
 
+#define THRU_SYSEX 0xFF
+
 SMT::SerialMidiTransport()
 {
 	latest_serial_byte = MidiType::InvalidType;
 	//uint8_t midi_rx_buffer[BUFFER_MAX_SIZE];
+	
+	thru_settings = nullptr;
+	release_stamp = 0;
+	latest_stamp = 0;
+	thru_status = MidiType::InvalidType;
+	thru_left = 0;
+	thru_forward = false;
+	thru_resend_status = false;
+	local_open = false;
+	thru_data = 0;
+	thru_cut = 0;
+	hold_count = 0;
+	sysex_source = nullptr;
 }
 
 void SMT::begin() { };				/* nothing to do */
 void SMT::end() { };				/* nothing to do */
-void SMT::endTransmission() { };	/* nothing to do */
-	
+
+/*
+	beginTransmission - our own messages never get spliced into a thru message
+		or wait for one to end. If a short one is half way through, ours cuts
+		it off and endTransmission sends it again from its status byte, so the
+		receiver still gets it whole. A SysEx being passed thru can't be cut:
+		false is returned (and the message isn't sent) then.
+*/
 bool SMT::beginTransmission(MidiType status)
 {
+#ifdef ENABLE_MIDI_OUTPUT
+	if (status >= MidiType::Clock)
+	{
+		return true; // real-time bytes can go anywhere
+	}
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if (thru_forward && thru_left == THRU_SYSEX)
+		{
+			return false;
+		}
+		
+		if (thru_forward && thru_left)
+		{
+			// no data byte out yet: only the status byte has to go again
+			thru_cut = thru_left == thru_data_bytes(thru_status) ? 1 : 2;
+		}
+		
+		local_open = true;
+		thru_resend_status = true;
+	}
+	return true;
+#else
+	(void) status;
 	return true;
+#endif
+}
+
+/*
+	endTransmission - lets through whatever thru bytes arrived while our
+		message was being written, after the start of the one it cut off
+*/
+void SMT::endTransmission()
+{
+#ifdef ENABLE_MIDI_OUTPUT
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		local_open = false;
+		if (thru_cut)
+		{
+			enqueue(thru_status);
+			if (thru_cut > 1)
+			{
+				enqueue(thru_data);
+			}
+			thru_cut = 0;
+			thru_resend_status = false;
+		}
+		
+		for (uint8_t i = 0; i < hold_count; i++)
+		{
+			enqueue(thru_hold[i]);
+		}
+		hold_count = 0;
+	}
+#endif
+}
+
+/*
+	thru_data_bytes - how many data bytes follow STATUS, THRU_SYSEX for a SysEx
+*/
+uint8_t SMT::thru_data_bytes(uint8_t status)
+{
+	switch (status & 0xF0)
+	{
+		case MidiType::ProgramChange:
+		case MidiType::AfterTouchChannel:
+			return 1;
+		
+		case 0xF0:
+			switch (status)
+			{
+				case MidiType::SystemExclusiveStart:	return THRU_SYSEX;
+				case MidiType::TimeCodeQuarterFrame:	return 1;
+				case MidiType::SongPosition:			return 2;
+				case MidiType::SongSelect:				return 1;
+				default:								return 0;
+			}
+		
+		default:
+			return 2;
+	}
+}
+
+/*
+	thru - called from the Rx interrupt with every byte received. A byte that
+		passes the thru filter is queued right away, so it goes out one byte
+		time after it came in instead of waiting for the main loop to parse it.
+*/
+void SMT::thru(uint8_t midi_byte)
+{
+	if (!thru_settings || thru_settings->mode == ThruOff)
+	{
+		// a message left half way when thru was turned off must not hold up ours
+		thru_status = MidiType::InvalidType;
+		thru_left = 0;
+		thru_forward = false;
+		return;
+	}
+	
+	if (midi_byte >= MidiType::Clock)
+	{
+		// real-time messages can be interleaved anywhere, even inside ours
+		if (thru_accepts(midi_byte))
+		{
+			enqueue(midi_byte);
+		}
+		return;
+	}
+	
+	if (midi_byte & 0x80)
+	{
+		if (midi_byte == MidiType::SystemExclusiveEnd && thru_left == THRU_SYSEX)
+		{
+			// the EOX belongs to the SysEx that's passing thru (or not)
+			thru_left = 0;
+		}
+		else
+		{
+			// a new status byte ends whatever message came before it
+			thru_status = midi_byte;
+			thru_forward = thru_accepts(midi_byte);
+			thru_left = thru_data_bytes(midi_byte);
+			
+			if (thru_forward)
+			{
+				thru_resend_status = false;
+			}
+		}
+		
+		if (thru_forward)
+		{
+			thru_out(midi_byte);
+		}
+		return;
+	}
+	
+	if (thru_left == 0)
+	{
+		// running status: another message without a status byte
+		if (thru_status < MidiType::NoteOff || thru_status >= MidiType::SystemExclusiveStart)
+		{
+			return; // stray data byte
+		}
+		
+		thru_left = thru_data_bytes(thru_status);
+		
+		if (thru_forward && thru_resend_status)
+		{
+			// the status the receiver is running on is the one of our last message
+			thru_resend_status = false;
+			thru_out(thru_status);
+		}
+	}
+	
+	if (thru_left != THRU_SYSEX && --thru_left)
+	{
+		thru_data = midi_byte; // the first of two, see endTransmission
+	}
+	
+	if (thru_forward)
+	{
+		thru_out(midi_byte);
+	}
+}
+
+bool SMT::thru_accepts(uint8_t status) const
+{
+	if (thru_settings->mode == ThruAll)
+	{
+		return true;
+	}
+	
+	uint16_t type;
+	if (status >= MidiType::Clock)
+	{
+		type = ThruRealTime;
+	}
+	else if (status >= MidiType::SystemExclusiveStart)
+	{
+		type = ThruSystem;
+	}
+	else
+	{
+		if (!(thru_settings->channels & (1 << (status & 0x0F))))
+		{
+			return false;
+		}
+		type = 1 << ((status >> 4) - 8);
+	}
+	
+	return thru_settings->types & type;
+}
+
+/*
+	thru_out - queues a thru byte, or holds it back while one of our own
+		messages is being written (they're let out by endTransmission).
+		Bytes past THRU_HOLD_SIZE are dropped and counted with the tx drops.
+*/
+void SMT::thru_out(uint8_t midi_byte)
+{
+	if (!local_open)
+	{
+		enqueue(midi_byte);
+	}
+	else if (hold_count < THRU_HOLD_SIZE)
+	{
+		thru_hold[hold_count++] = midi_byte;
+	}
+	else
+	{
+		midi_tx_buffer.count_drop();
+	}
 }
 
+/*
+	enqueue - queues a byte for the USART_UDRE interrupt, or writes it straight
+		into the data register if the USART is idle. Interrupts must be off.
+*/
+void SMT::enqueue(uint8_t midi_byte)
+{
+#ifdef ENABLE_MIDI_OUTPUT
+	if (!midi_tx_buffer.ready() && bit_is_set(UCSR0A, UDRE0))
+	{
+		UDR0 = midi_byte;
+		return;
+	}
 	
+	if (!midi_tx_buffer.full())
+	{
+		midi_tx_buffer.put(midi_byte);
+		UCSR0B |= DATA_REGISTER_EMPTY_INTERRUPT;
+	}
+	else
+	{
+		// dropping the oldest byte would break a message that's half sent
+		midi_tx_buffer.count_drop();
+	}
+#else
+	(void) midi_byte;
+#endif
+}
+
+	
+/*
+	write - queues a byte for the USART_UDRE interrupt to send. It never
+		waits: if the queue is full the byte is dropped and counted, so
+		callers check space() first when a message mustn't be cut short.
+*/
 void SMT::write(uint8_t msg)
 {
-	//cli();
-	midi_tx_buffer.put(msg);
-	//sei();
+#ifdef ENABLE_MIDI_OUTPUT
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		enqueue(msg);
+	}
+#else
+	(void) msg;
+#endif
 };
 
+/* bytes a SysEx with SIZE data bytes takes on the wire */
+static uint8_t sysex_length(uint8_t size)
+{
+	return 1 + SYSEX_HEADER_SIZE + size + (size + 6) / 7 + 2;
+}
+
+/*
+	writeSysEx - sends COMMAND and DATA in the format described in Sysex.h.
+		The whole message has to fit in the tx queue, else it's dropped
+		(and counted) and false returned.
+*/
+bool SMT::writeSysEx(uint8_t command, const uint8_t* data, uint8_t size)
+{
+	if (!sysex_message(command, data, size))
+	{
+		tx_drop();
+		return false;
+	}
+	return true;
+}
+
+/*
+	writeSysEx - starts sending SIZE bytes from SOURCE as a series of
+		chunks, <tag> <first> <up to SYSEX_CHUNK bytes> (see Sysex.h).
+		pumpSysEx sends each one once the tx queue has room for it, reading
+		its bytes from SOURCE then, so a long reply needs no buffer, never
+		holds the loop up, and thru traffic goes out between its chunks.
+		False if another one is still going.
+*/
+bool SMT::writeSysEx(uint8_t command, uint8_t tag, SysexSource source, uint8_t size)
+{
+	if (sysex_source)
+	{
+		tx_drop();
+		return false;
+	}
+	
+	sysex_source = source;
+	sysex_command = command;
+	sysex_tag = tag;
+	sysex_size = size;
+	sysex_idx = 0;
+	pumpSysEx();
+	return true;
+}
+
+void SMT::pumpSysEx()
+{
+	uint8_t chunk[2 + SYSEX_CHUNK];
+	
+	while (sysex_source)
+	{
+		// room is left for as many thru bytes as may be held while the chunk goes
+		uint8_t len = sysex_size - sysex_idx < SYSEX_CHUNK ? sysex_size - sysex_idx : SYSEX_CHUNK;
+		if (midi_tx_buffer.space() < sysex_length(2 + len) + THRU_HOLD_SIZE)
+		{
+			return;
+		}
+		
+		chunk[0] = sysex_tag;
+		chunk[1] = sysex_idx;
+		for (uint8_t j = 0; j < len; j++)
+		{
+			chunk[2 + j] = sysex_source(sysex_idx + j);
+		}
+		
+		if (!sysex_message(sysex_command, chunk, 2 + len))
+		{
+			return; // a SysEx is passing thru, the chunk goes once it's over
+		}
+		
+		sysex_idx += len;
+		if (sysex_idx == sysex_size)
+		{
+			sysex_source = nullptr;
+		}
+	}
+}
+
+/*
+	sysex_message - packs DATA 7 bytes at a time as it's written, if there's
+		room for the whole message and it can start (see beginTransmission)
+*/
+bool SMT::sysex_message(uint8_t command, const uint8_t* data, uint8_t size)
+{
+	uint8_t sum = 0;
+	
+	if (midi_tx_buffer.space() < sysex_length(size) || !beginTransmission(MidiType::SystemExclusiveStart))
+	{
+		return false;
+	}
+	
+	write(MidiType::SystemExclusiveStart);
+	write(SYSEX_MANUFACTURER_ID);
+	write(SYSEX_DEVICE_ID);
+	write(command);
+	
+	for (uint8_t i = 0; i < size; i += 7)
+	{
+		sysex_group(data + i, size - i < 7 ? size - i : 7, &sum);
+	}
+	
+	write(-sum & 0x7F);
+	write(MidiType::SystemExclusiveEnd);
+	endTransmission();
+	return true;
+}
+
+void SMT::tx_drop()
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		midi_tx_buffer.count_drop();
+	}
+}
+
+/*
+	sysex_group - packs and sends up to 7 data bytes, adding them to SUM
+*/
+void SMT::sysex_group(const uint8_t* data, uint8_t len, uint8_t* sum)
+{
+	byte packed[9];		// encodeSysEx clears the header of the next group after a full one
+	
+	len = encodeSysEx(data, packed, len);
+	for (uint8_t j = 0; j < len; j++)
+	{
+		*sum += packed[j];
+		write(packed[j]);
+	}
+}
 
 uint8_t SMT::read()
 {
 	//cli();
-	uint8_t available = midi_rx_buffer.get(&latest_serial_byte);
+	StampedByte rx;
+	uint8_t available = midi_rx_buffer.get(&rx);
 	//sei();
 	
-	if (available)
-	{
-		return latest_serial_byte;
-	}
-	else
+	if (!available)
 	{
 		// the buffer must have been empty
 		return MidiType::InvalidType;
 	}
+	
+	latest_serial_byte = rx.data;
+	latest_stamp = rx.stamp;
+	
+	if (sysex.consume(latest_serial_byte))
+	{
+		// SysEx is decoded by the transport, the parser ignores Undefined_FD
+		return MidiType::Undefined_FD;
+	}
+	
+	return latest_serial_byte;
 };
 
+/*
+	available - a byte only becomes available once it's older than
+		release_stamp, so messages are handled a fixed time after they
+		arrived rather than whenever the main loop gets to them
+*/
 unsigned SMT::available()
 {
-	//cli();
-	uint8_t result = midi_rx_buffer.ready();
-	//sei();
+	StampedByte rx;
+	if (!midi_rx_buffer.peek(&rx) || (int16_t) (release_stamp - rx.stamp) < 0)
+	{
+		return 0;
+	}
 	
-	return result;
+	return midi_rx_buffer.ready();
 };
 
@@ -13,25 +13,97 @@
 #include <avr/eeprom.h>
 
 #include "CircularBuffer.h"
+#include "GPIO.h"
+#include "Sysex.h"
 #include "lib/midi_Namespace.h"
 #include "lib/midi_Defs.h"
 #include "lib/MIDI.h"
 
-#define SIZE 100
+/* Received bytes wait RX_LATENCY_US (about 4 bytes at full MIDI rate, the
+   peak the replay captures reach) plus however long the loop is held up:
+   32 covers another 9ms of back to back bytes. */
+#define RX_BUFFER_SIZE 32
+
+/* Only has to hold the longest short SysEx reply in one go (long ones are
+   pumped into it a chunk at a time, see pumpSysEx): task stats 36 bytes, a
+   histogram 44, ISR stats 73 */
+#ifdef ENABLE_ISR_PROFILE
+#define TX_BUFFER_SIZE 80
+#else
+#define TX_BUFFER_SIZE 48
+#endif
 
 #define SMT MIDI_NAMESPACE::SerialMidiTransport
 
+#define THRU_HOLD_SIZE 8
+
+enum ThruMode { ThruOff, ThruAll, ThruFiltered };
+
+/* bits of ThruSettings::types. The channel messages are in status byte order:
+   bit n is status 0x80 + (n << 4) */
+enum ThruType
+{
+	ThruNoteOff				= 1 << 0,
+	ThruNoteOn				= 1 << 1,
+	ThruPolyPressure		= 1 << 2,
+	ThruControlChange		= 1 << 3,
+	ThruProgramChange		= 1 << 4,
+	ThruChannelPressure		= 1 << 5,
+	ThruPitchBend			= 1 << 6,
+	ThruSystem				= 1 << 7,	/* SysEx and system common */
+	ThruRealTime			= 1 << 8,	/* clock, start/stop, active sensing */
+	ThruAllTypes			= 0x1FF,
+};
+
+struct ThruSettings
+{
+	ThruMode mode;
+	uint16_t channels;	/* ThruFiltered: bit n passes channel n+1 */
+	uint16_t types;		/* ThruFiltered: ThruType bits that pass */
+};
+
+/* a received byte and when it arrived, in 4us Timer2 ticks (see MidiController::stamp) */
+struct StampedByte
+{
+	uint8_t data;
+	uint16_t stamp;
+};
+
 BEGIN_MIDI_NAMESPACE
 class SerialMidiTransport
 {
 
 /***** FIELDS *****/
 public:
-	CircularBuffer<uint8_t, 100> midi_rx_buffer;
-	CircularBuffer<uint8_t, 100> midi_tx_buffer;
+	CircularBuffer<StampedByte, RX_BUFFER_SIZE> midi_rx_buffer;
+	CircularBuffer<uint8_t, TX_BUFFER_SIZE> midi_tx_buffer;
+	SysexReceiver sysex;
+	
+	const ThruSettings* thru_settings;
+	
+	uint16_t release_stamp;		/* bytes stamped after this aren't handed to the parser yet */
+	uint16_t latest_stamp;		/* arrival time of the last byte read */
 	
 private:
 	uint8_t latest_serial_byte;
+	
+	/* hardware thru, see thru() */
+	volatile uint8_t thru_status;		/* status of the message being received */
+	volatile uint8_t thru_left;			/* data bytes still to come for it, THRU_SYSEX until EOX */
+	volatile bool thru_forward;			/* whether it passed the filter */
+	volatile uint8_t thru_data;			/* its first data byte, when it has two */
+	volatile uint8_t thru_cut;			/* its bytes that went out before ours cut it off */
+	volatile bool thru_resend_status;	/* one of our messages went out since its status byte did */
+	volatile bool local_open;			/* one of our messages is being written */
+	uint8_t thru_hold[THRU_HOLD_SIZE];	/* thru bytes waiting for our message to finish */
+	volatile uint8_t hold_count;
+	
+	/* SysEx chunks read from a SysexSource as the tx queue makes room, see pumpSysEx */
+	SysexSource sysex_source;
+	uint8_t sysex_command;
+	uint8_t sysex_tag;
+	uint8_t sysex_size;
+	uint8_t sysex_idx;
 
 /***** METHODS *****/
 public:
@@ -41,8 +113,21 @@ public:
 	bool beginTransmission(MIDI_NAMESPACE::MidiType status);
 	void endTransmission();
 	void write(uint8_t byte);
+	bool writeSysEx(uint8_t command, const uint8_t* data, uint8_t size);
+	bool writeSysEx(uint8_t command, uint8_t tag, SysexSource source, uint8_t size);
+	void pumpSysEx();
 	uint8_t read();
 	unsigned available();
+	void thru(uint8_t byte);
+
+private:
+	static uint8_t thru_data_bytes(uint8_t status);
+	bool thru_accepts(uint8_t status) const;
+	void thru_out(uint8_t byte);
+	void enqueue(uint8_t byte);
+	bool sysex_message(uint8_t command, const uint8_t* data, uint8_t size);
+	void sysex_group(const uint8_t* data, uint8_t len, uint8_t* sum);
+	void tx_drop();
 };
 
 END_MIDI_NAMESPACE
@@ -0,0 +1,91 @@
+/*
+ * Serializable.cpp
+ *
+ * see Serializable.h
+ */
+
+#include <string.h>
+
+#include "Serializable.h"
+
+namespace
+{
+	class ImageWriter : public SerialCursor
+	{
+		public:
+		uint8_t* buffer;
+		ImageWriter(uint8_t* buf) : buffer(buf) { }
+		void field(void* data, size_t size) override
+		{
+			memcpy(buffer, data, size);
+			buffer += size;
+		}
+	};
+	
+	class ImageReader : public SerialCursor
+	{
+		public:
+		const uint8_t* buffer;
+		ImageReader(const uint8_t* buf) : buffer(buf) { }
+		void field(void* data, size_t size) override
+		{
+			memcpy(data, buffer, size);
+			buffer += size;
+		}
+	};
+	
+	class ImageCounter : public SerialCursor
+	{
+		public:
+		size_t size;
+		ImageCounter() : size(0) { }
+		void field(void*, size_t len) override { size += len; }
+	};
+	
+	/* finds the field byte IDX of the image falls in */
+	class ImageSeeker : public SerialCursor
+	{
+		public:
+		size_t idx;
+		uint8_t* found;
+		ImageSeeker(size_t i) : idx(i), found(nullptr) { }
+		void field(void* data, size_t size) override
+		{
+			if (!found && idx < size)
+			{
+				found = (uint8_t*) data + idx;
+			}
+			idx -= size;
+		}
+	};
+}
+
+void Serializable::serialize(uint8_t* buffer) const
+{
+	ImageWriter writer(buffer);
+	const_cast<Serializable*>(this)->walk(writer);
+}
+
+void Serializable::deserialize(const uint8_t* buffer)
+{
+	ImageReader reader(buffer);
+	walk(reader);
+}
+
+size_t Serializable::size_bytes() const
+{
+	ImageCounter counter;
+	const_cast<Serializable*>(this)->walk(counter);
+	return counter.size;
+}
+
+/*
+	byte - where byte IDX of the image lives in the object, nullptr past
+		its end
+*/
+uint8_t* Serializable::byte(size_t idx)
+{
+	ImageSeeker seeker(idx);
+	walk(seeker);
+	return seeker.found;
+}
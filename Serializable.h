@@ -9,14 +9,40 @@
 #ifndef SERIALIZABLE_H_
 #define SERIALIZABLE_H_
 
+#include <stdint.h>
+#include <stddef.h>
 
+/*
+	SerialCursor - visits the fields of a settings image in order, see
+		Serializable::walk
+*/
+class SerialCursor
+{
+	public:
+	virtual void field(void* data, size_t size) = 0;
+};
+
+/*
+	Every settings class lists its fields once, in image order, in walk().
+	The image, its size and where each of its bytes lives all follow from
+	that list, so it can be copied as a whole or streamed a byte at a time
+	(SysEx, EEPROM) without a buffer. Fields are imaged as they are in
+	memory: the AVR is little endian and enums are one byte (-fshort-enums).
+*/
 class Serializable
 {
 	public:
-	virtual void serialize(uint8_t* buffer) const = 0;
-	virtual void deserialize(const uint8_t* buffer) = 0;
-	virtual size_t size_bytes() const = 0;
+	virtual void walk(SerialCursor& cursor) = 0;
+	
+	/* whether every field holds a value the firmware can run with: an
+	   uploaded image is only applied if all of its parts are */
+	virtual bool valid() const { return true; }
+	
+	void serialize(uint8_t* buffer) const;
+	void deserialize(const uint8_t* buffer);
+	size_t size_bytes() const;
+	uint8_t* byte(size_t idx);
 };
 
 
-#endif /* SERIALIZABLE_H_ */
\ No newline at end of file
+#endif /* SERIALIZABLE_H_ */
@@ -0,0 +1,51 @@
+/*
+ * StackMonitor.cpp
+ *
+ * See StackMonitor.h. The painting is done in .init1, before the C
+ * runtime has set up r1 or the stack pointer, so it's plain assembly.
+ */ 
+
+#include <avr/io.h>
+
+#include "StackMonitor.h"
+
+extern uint8_t _end;	/* end of .data/.bss, from the linker */
+extern uint8_t __stack;	/* top of RAM */
+
+void paint_stack() __attribute__ ((naked, used, section(".init1")));
+
+void paint_stack()
+{
+	__asm volatile (
+		"	ldi r30, lo8(_end)		\n"
+		"	ldi r31, hi8(_end)		\n"
+		"	ldi r24, %0				\n"
+		"	ldi r25, hi8(__stack)	\n"
+		"	rjmp 2f					\n"
+		"1:	st Z+, r24				\n"
+		"2:	cpi r30, lo8(__stack)	\n"
+		"	cpc r31, r25			\n"
+		"	brlo 1b					\n"
+		"	breq 1b					\n"
+		:: "M" (STACK_CANARY)
+	);
+}
+
+/*
+	stack_unused - bytes of RAM the stack has never reached. It takes a scan
+		of up to ~1.5KB, so call it from a slow task rather than often.
+*/
+uint16_t stack_unused()
+{
+	const uint8_t* p = &_end;
+	while (p <= &__stack && *p == STACK_CANARY)
+	{
+		p++;
+	}
+	return p - &_end;
+}
+
+uint16_t static_ram_used()
+{
+	return &_end - (uint8_t*) RAMSTART;
+}
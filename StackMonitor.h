@@ -0,0 +1,25 @@
+/*
+ * StackMonitor.h
+ *
+ * Stack painting. Before anything else runs, all of the RAM above the
+ * static variables (_end up to the top of RAM) is filled with
+ * STACK_CANARY. The stack grows down into it, so the painted bytes left
+ * above _end are how close the stack has ever come to the variables.
+ * Nothing here uses the heap, so there's nothing else in between.
+ */ 
+
+
+#ifndef STACKMONITOR_H_
+#define STACKMONITOR_H_
+
+#include <stdint.h>
+
+#define STACK_CANARY	0xC5
+
+/* below this many never-used bytes the stack is getting too close */
+#define STACK_MARGIN	64
+
+uint16_t stack_unused();
+uint16_t static_ram_used();
+
+#endif /* STACKMONITOR_H_ */
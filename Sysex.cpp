@@ -0,0 +1,145 @@
+/*
+ * Sysex.cpp
+ *
+ * Incremental SysEx decoder, see Sysex.h for the message format.
+ */ 
+
+#include "lib/midi_Defs.h"
+
+#include "Sysex.h"
+
+SysexReceiver::SysexReceiver()
+{
+	sink = nullptr;
+	callback = nullptr;
+	state = Idle;
+	errors = 0;
+}
+
+/*
+	consume - called with every byte read from MIDI in. Returns true if the
+		byte belonged to a SysEx message (and must not be parsed any further).
+*/
+bool SysexReceiver::consume(uint8_t midi_byte)
+{
+	// real-time messages can be interleaved anywhere, even inside SysEx
+	if (midi_byte >= MIDI_NAMESPACE::Clock)
+	{
+		return false;
+	}
+	
+	if (midi_byte == MIDI_NAMESPACE::SystemExclusiveStart)
+	{
+		if (state == Payload)
+		{
+			finish(false); // the last one never got its EOX
+		}
+		state = Header;
+		header_idx = 0;
+		group_idx = 0;
+		held = -1;
+		sum = 0;
+		size = 0;
+		overflow = false;
+		return true;
+	}
+	
+	if (state == Idle)
+	{
+		return false;
+	}
+	
+	if (midi_byte == MIDI_NAMESPACE::SystemExclusiveEnd)
+	{
+		if (state == Payload)
+		{
+			finish(true);
+		}
+		state = Idle;
+		return true;
+	}
+	
+	if (midi_byte & 0x80)
+	{
+		// any other status byte ends the SysEx without an EOX, drop it
+		if (state == Payload)
+		{
+			finish(false);
+		}
+		state = Idle;
+		return false;
+	}
+	
+	switch (state)
+	{
+		case Header:
+			if ((header_idx == 0 && midi_byte != SYSEX_MANUFACTURER_ID) ||
+				(header_idx == 1 && midi_byte != SYSEX_DEVICE_ID))
+			{
+				state = Ignore;
+			}
+			else if (header_idx == 2)
+			{
+				command = midi_byte;
+				state = Payload;
+			}
+			header_idx++;
+			break;
+		
+		case Payload:
+			if (held >= 0)
+			{
+				unpack(held);
+			}
+			held = midi_byte;
+			break;
+		
+		default:
+			break;
+	}
+	
+	return true;
+}
+
+void SysexReceiver::unpack(uint8_t packed_byte)
+{
+	sum += packed_byte;
+	
+	if (group_idx == 0)
+	{
+		msbs = packed_byte;
+	}
+	else if (size < UINT8_MAX)
+	{
+		if (sink)
+		{
+			sink(command, size, packed_byte | ((msbs << group_idx) & 0x80));
+		}
+		size++;
+	}
+	else
+	{
+		overflow = true;
+	}
+	
+	group_idx = (group_idx + 1) & 0x07;
+}
+
+/*
+	finish - the message is over: ENDED if its EOX arrived, then HELD is the
+		checksum. The sink has already seen the data either way, so the
+		callback is told when it has to be undone.
+*/
+void SysexReceiver::finish(bool ended)
+{
+	bool ok = ended && held >= 0 && !overflow && ((sum + held) & 0x7F) == 0;
+	if (!ok)
+	{
+		errors++;
+	}
+	
+	if (callback)
+	{
+		callback(command, size, ok);
+	}
+}
@@ -0,0 +1,141 @@
+/*
+ * Sysex.h
+ *
+ * SysEx protocol. Every message looks like
+ *
+ *		F0 7D 46 <command> <packed data ...> <checksum> F7
+ *
+ * 7D is the manufacturer ID reserved for non-commercial use and 46 ('F')
+ * picks out this device. The data is packed like MIDI_NAMESPACE::encodeSysEx
+ * does it, 7 bytes of data into 8 bytes of SysEx. The checksum is chosen so
+ * that the packed bytes plus the checksum add up to 0 (mod 128).
+ *
+ * SysEx never reaches the MIDI library. The transport hands every byte of
+ * it to a SysexReceiver as it is read, which unpacks it on the fly and
+ * passes each data byte straight on to where it's going (see
+ * SysexReceiver::Sink), so a long transfer only costs a few instructions
+ * per byte in the main loop and no RAM to hold it.
+ *
+ * Replies (dumps, stats, Ack/Nak) need MIDI output, which is off by default
+ * (ENABLE_MIDI_OUTPUT in GPIO.h). Without it requests get no answer at all;
+ * uploads are still received and applied, just never acknowledged.
+ */ 
+
+
+#ifndef SYSEX_H_
+#define SYSEX_H_
+
+#include <stdint.h>
+
+#define SYSEX_MANUFACTURER_ID	0x7D
+#define SYSEX_DEVICE_ID			0x46
+#define SYSEX_HEADER_SIZE		3		/* manufacturer, device, command */
+
+/* Data too long for one message is sent in chunks, each a message of its own:
+ *
+ *		<tag> <first> <up to SYSEX_CHUNK bytes>
+ *
+ * FIRST is where the chunk's bytes go in the whole, TAG is the same in every
+ * chunk (see the commands). Replies go out a chunk at a time as the tx queue
+ * makes room, with any MIDI thru traffic in between. Uploads are Acked a
+ * chunk at a time and the next one may only be sent after the Ack: a
+ * SysexNoteOffsetsData chunk is written to EEPROM (3.3ms a byte) first. */
+#define SYSEX_CHUNK		8
+
+enum SysexCommand
+{
+	/* replies to messages that change settings:		<command> */
+	SysexAck				= 0x01,
+	SysexNak				= 0x02,
+	
+	/* per-note calibration offsets in cents (int8), one per note from MIDI_NOTE_MIN
+		request:	<output>
+		data:		chunks tagged <output>			the reply has all NUM_NOTES, an upload
+													any chunks, each one saved as it comes */
+	SysexNoteOffsetsRequest	= 0x10,
+	SysexNoteOffsetsData	= 0x11,
+	
+	/* all settings, laid out like the EEPROM image (see config_byte). An upload
+		is staged and only applied and saved once the last chunk is in and every
+		field is in range; a chunk out of order or a bad image drops the upload
+		request:	(nothing)
+		reply:		chunks tagged <version> of the settings image
+		upload:		chunks tagged <version>, in order from 0 */
+	SysexConfigRequest		= 0x20,
+	SysexConfigData			= 0x21,
+	
+	/* main loop timing, all values 16-bit little endian, tasks in priority order
+		request:	[<clear>]						clear the stats after replying if non-zero
+		data:		<idle permille> <wcet us> <misses> ... */
+	SysexTaskStatsRequest	= 0x30,
+	SysexTaskStatsData		= 0x31,
+	
+	/* timing histograms (see Histogram.h), counts 16-bit little endian
+		request:	<HistogramId> [<clear>]
+		data:		<HistogramId> <HIST_BUCKETS counts> */
+	SysexHistogramRequest	= 0x32,
+	SysexHistogramData		= 0x33,
+	
+	/* ring buffer use: for MIDI Rx, MIDI Tx, latest notes A & B, clock periods
+		request:	[<clear>]
+		data:		<peak> <capacity> <drops, 16-bit little endian> ... */
+	SysexBufferStatsRequest	= 0x34,
+	SysexBufferStatsData	= 0x35,
+	
+	/* RAM use (see StackMonitor.h), 16-bit little endian
+		request:	(nothing)
+		data:		<static RAM used> <stack bytes never used> <under STACK_MARGIN> */
+	SysexMemoryStatsRequest	= 0x36,
+	SysexMemoryStatsData	= 0x37,
+	
+	/* ISR run times, only answered by ENABLE_ISR_PROFILE builds (see IsrProfile.h)
+		request:	[<clear>]
+		data:		<min us> <max us> <avg us> <count> ... per IsrId, then <Rx overruns>,
+					all 16-bit little endian */
+	SysexIsrStatsRequest	= 0x38,
+	SysexIsrStatsData		= 0x39,
+};
+
+/* byte IDX of a message that's sent as it's packed, rather than from a buffer */
+typedef uint8_t (*SysexSource)(uint8_t idx);
+
+class SysexReceiver
+{
+public:
+	/* called with every data byte as it's unpacked, before the checksum is in */
+	typedef void (*Sink)(uint8_t command, uint8_t idx, uint8_t value);
+	
+	/* called once the message has ended, OK is false if it has to be thrown away */
+	typedef void (*Callback)(uint8_t command, uint8_t size, bool ok);
+	
+private:
+	enum State { Idle, Header, Payload, Ignore };
+	
+	Sink sink;
+	Callback callback;
+	State state;
+	uint8_t header_idx;
+	uint8_t command;
+	
+	/* unpacking */
+	uint8_t group_idx;	/* position in the current group of 8 packed bytes */
+	uint8_t msbs;		/* first byte of the group: the top bits of the next 7 */
+	int16_t held;		/* last byte received, could still turn out to be the checksum */
+	uint8_t sum;
+	uint8_t size;
+	bool overflow;
+
+public:
+	uint8_t errors;		/* messages dropped for a bad checksum or length */
+
+public:
+	SysexReceiver();
+	void setHandlers(Sink sk, Callback cb) { sink = sk; callback = cb; }
+	bool consume(uint8_t midi_byte);
+
+private:
+	void unpack(uint8_t packed_byte);
+	void finish(bool ended);
+};
+
+#endif /* SYSEX_H_ */
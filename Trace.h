@@ -0,0 +1,52 @@
+/*
+ * Trace.h
+ *
+ * Logic analyzer tracing (define ENABLE_TRACE in GPIO.h). Each traced
+ * region has its own pin (see TRACE PINS in GPIO.h) which is high while
+ * the region runs, so its timing can be read off a logic analyzer or a
+ * simavr VCD trace. Setting and clearing a pin is one sbi/cbi each.
+ *
+ * Put TRACE_SCOPE(<region>) at the top of a block to trace the whole
+ * block, or TRACE_BEGIN/TRACE_END around part of one. With ENABLE_TRACE
+ * undefined all of these are empty.
+ */ 
+
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <avr/io.h>
+
+#include "GPIO.h"
+
+#ifdef ENABLE_TRACE
+
+#define TRACE_BEGIN(region)		set_bit(TRACE_##region##_PORT, TRACE_##region##_BIT)
+#define TRACE_END(region)		clear_bit(TRACE_##region##_PORT, TRACE_##region##_BIT)
+
+#define TRACE_SCOPE(region)												\
+	struct TraceScope_##region											\
+	{																	\
+		TraceScope_##region() { TRACE_BEGIN(region); }					\
+		~TraceScope_##region() { TRACE_END(region); }					\
+	} trace_scope_##region
+
+/* make the trace pins outputs, called from hardware_init */
+#define TRACE_INIT()													\
+	do {																\
+		set_bit(TRACE_PARSE_DDR, TRACE_PARSE_BIT);						\
+		set_bit(TRACE_DISPATCH_DDR, TRACE_DISPATCH_BIT);				\
+		set_bit(TRACE_DAC_DDR, TRACE_DAC_BIT);							\
+		set_bit(TRACE_EEPROM_DDR, TRACE_EEPROM_BIT);					\
+	} while (0)
+
+#else
+
+#define TRACE_BEGIN(region)
+#define TRACE_END(region)
+#define TRACE_SCOPE(region)
+#define TRACE_INIT()
+
+#endif /* ENABLE_TRACE */
+
+#endif /* TRACE_H_ */
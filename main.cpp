@@ -8,16 +8,22 @@
 
 #define F_CPU 16000000UL
 
-//#define ENABLE_MIDI_OUTPUT 1
-
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/sfr_defs.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
 #include <util/delay.h>
 
 #include "GPIO.h"
 #include "MidiController.h"
 #include "EEPromManager.h"
+#include "Calibration.h"
+#include "IsrProfile.h"
+#include "Scheduler.h"
+#include "StackMonitor.h"
+#include "Trace.h"
+#include "Sysex.h"
 
 #define MOMENTARY_SW_DEBOUNCE_MS 500
 #define MIDDLE_C 60
@@ -47,6 +53,35 @@ uint8_t channel_count = 0;
 uint8_t keyboard_prefs[8] {};
 uint8_t key_pref_count = 0;
 
+/* main loop tasks, see the task table below main() */
+void task_midi();
+void task_outputs();
+void task_learn_switch();
+void task_panel_switches();
+void task_stack_check();
+void task_note_tables();
+uint32_t clock_us() { return mctl.micros(); }
+
+Task tasks[] = {
+	/* run					period us	deadline us		priority */
+	{ task_midi,			0,			1000,			0 },
+	{ task_outputs,			1000,		1000,			1 },
+	{ task_learn_switch,	1000,		5000,			2 },
+	{ task_panel_switches,	20000,		5000,			3 },	/* the period debounces them */
+	{ task_stack_check,		50000,		5000,			4 },
+	{ task_note_tables,		1000,		5000,			5 },	/* only busy after a calibration change */
+};
+Scheduler scheduler(tasks, sizeof(tasks) / sizeof(tasks[0]), clock_us);
+
+/* headroom: share of the last second the loop spent asleep, in 1/1000 */
+uint32_t idle_us = 0;
+uint32_t idle_window_start = 0;
+uint16_t idle_permille = 0;
+
+/* stack watermark, see StackMonitor.h */
+uint16_t stack_free = 0;
+bool stack_low = false;
+
 // Event handlers
 void register_midi_events();
 void unregister_midi_events();
@@ -131,6 +166,79 @@ void check_learn_switch()
 	last_button_state = button_pressed;
 }
 
+/*
+	run_calibration - entered by holding the learn switch while powering on.
+		Calibrates V/oct A (read back on ADC6) and V/oct B (ADC7) and saves
+		the result. Each output's LED ends green if it was calibrated or red if
+		the measurement failed and the previous calibration was kept.
+*/
+void run_calibration()
+{
+	leda_red();
+	ledb_red();
+	
+	if (calibrate_output(mctl.cv_out_a, CAL_ADC_CH_A))
+	{
+		leda_green();
+	}
+	
+	if (calibrate_output(mctl.cv_out_b, CAL_ADC_CH_B))
+	{
+		ledb_green();
+	}
+	
+	save_config(mctl);
+	
+	// wait for the switch to be let go so it isn't seen as a single click
+	while (!bit_is_set(LEARN_SW_PIN, LEARN_SW));
+	_delay_ms(DEBOUNCE_DELAY);
+	
+	leda_off();
+	ledb_off();
+}
+
+/*
+	idle - sleeps until the next interrupt that has work for the loop,
+		unless received MIDI is waiting. A byte is only parsed once it's
+		RX_LATENCY_US old and no interrupt marks that moment, so while any
+		byte is buffered the loop keeps spinning instead: sleeping would hold
+		it until the next 1ms tick. Otherwise the Timer2 tick, received
+		bytes and switch edges wake the loop (see wake_loop). The others, the
+		VEL dither every few PWM periods above all, only run their ISR and
+		the CPU goes straight back to sleep, which keeps digital noise off
+		the supply while the CVs settle.
+*/
+volatile bool wake_loop = false;
+
+void idle()
+{
+	uint32_t start = mctl.micros();
+	
+	cli();
+	if (!mctl.midi_buffered())
+	{
+		while (!wake_loop)
+		{
+			sleep_enable();
+			sei(); // the instruction after sei always runs: no interrupt can sneak in before sleep
+			sleep_cpu();
+			sleep_disable();
+			cli();
+		}
+	}
+	wake_loop = false;
+	sei();
+	
+	uint32_t now = mctl.micros();
+	idle_us += now - start;
+	if (now - idle_window_start >= 1000000UL)
+	{
+		idle_permille = idle_us / ((now - idle_window_start) / 1000);
+		idle_us = 0;
+		idle_window_start = now;
+	}
+}
+
 int main()
 {
 	cli(); // disable interrupts globally
@@ -141,29 +249,69 @@ int main()
 		save_config(mctl);
 	ledc_off();
 	
+	if (!bit_is_set(LEARN_SW_PIN, LEARN_SW))
+		run_calibration();
+	
+	load_note_tables(mctl);
+	mctl.build_step_table();
+	
 	register_midi_events();
+	set_sleep_mode(SLEEP_MODE_IDLE); // the timers and the USART keep running
+#ifdef ENABLE_ISR_PROFILE
+	isr_profile_clear();
+#endif
 	sei(); // enable interrupts globally
 	
-	uint16_t idx = 0;
+	scheduler.start();
 	while (1)
 	{
-		check_learn_switch();
-		if (mode == MidiRx)
-		{
-			// LEDTODO: if (idx % 2 == 0) { status1_green(); }
-			// LEDTODO: else { status1_red(); }
-			
-			mctl.update();	
-		}
-		else
-		{
-			mctl.midi.read();
-		}
-		idx++;
+		scheduler.run();
+		idle();
 	}
 	return 0;
 }
 
+/**************************************************/
+/*			Tasks								  */
+/**************************************************/
+void task_midi()
+{
+	// in the learn modes this is all that runs, the note handlers are swapped
+	mctl.read_midi();
+	mctl.write_midi();
+}
+
+void task_outputs()
+{
+	if (mode == MidiRx)
+		mctl.update_outputs();
+}
+
+void task_learn_switch()
+{
+	check_learn_switch();
+}
+
+void task_panel_switches()
+{
+	if (mode == MidiRx)
+		mctl.update_switches();
+}
+
+void task_stack_check()
+{
+	stack_free = stack_unused();
+	if (stack_free < STACK_MARGIN)
+		stack_low = true; // stays set until the next reset
+}
+
+void task_note_tables()
+{
+	// one output at a time, the EEPROM can only write one byte anyway
+	if (!mctl.cv_out_a.update_note_table())
+		mctl.cv_out_b.update_note_table();
+}
+
 
 /**************************************************/
 /*			Learn CHANNEL Mode					  */
@@ -238,36 +386,414 @@ void learn_keyboard_note_on(uint8_t midi_note)
 }
 
 
+/**************************************************/
+/*			SysEx								  */
+/**************************************************/
+CvOutput& cv_output(uint8_t output)
+{
+	return output ? mctl.cv_out_b : mctl.cv_out_a;
+}
+
+/* short messages are kept here as they're received, see sysex_byte */
+#define SYSEX_ARGS_MAX	(2 + SYSEX_CHUNK)
+uint8_t sysex_args[SYSEX_ARGS_MAX];
+
+uint8_t offsets_output = 0;		/* output the note offsets being sent are for */
+
+uint8_t note_offsets_byte(uint8_t idx)
+{
+	return cv_output(offsets_output).note_offset(idx);
+}
+
+/*
+	send_note_offsets - replies with the saved per-note offsets of OUTPUT,
+		read from EEPROM as they're sent
+*/
+void send_note_offsets(uint8_t output)
+{
+	offsets_output = output;
+	mctl.send_sysex(SysexNoteOffsetsData, output, note_offsets_byte, NUM_NOTES);
+}
+
+/*
+	receive_note_offsets - saves one uploaded chunk of per-note offsets
+		(see SysexNoteOffsetsData) and rebuilds the note tables
+*/
+bool receive_note_offsets(uint8_t size)
+{
+	uint8_t first = sysex_args[1];
+	uint8_t count = size - 2;
+	if (size < 2 || size > SYSEX_ARGS_MAX || first + count > NUM_NOTES)
+	{
+		return false;
+	}
+	
+	uint8_t dac_ch = cv_output(sysex_args[0]).dac_ch;
+	for (uint8_t i = 0; i < count; i++)
+	{
+		save_note_offset(dac_ch, first + i, (int8_t) sysex_args[2 + i]);
+	}
+	
+	load_note_tables(mctl);
+	return true;
+}
+
+uint8_t config_dump_byte(uint8_t idx)
+{
+	return *config_byte(mctl, idx + 1); // the version is the tag
+}
+
+void send_config()
+{
+	mctl.send_sysex(SysexConfigData, CONFIG_VERSION, config_dump_byte, config_size(mctl) - 1);
+}
+
+/* an uploaded settings image is put together here, chunk by chunk, and only
+   applied once it's whole and every part of it is valid */
+MctlSettings staged_settings;
+CvSettings staged_cv_a;
+CvSettings staged_cv_b;
+ModSettings staged_mod;
+Serializable* staged_parts[CONFIG_PARTS] = {&staged_settings, &staged_cv_a, &staged_cv_b, &staged_mod};
+size_t staged_size = 0;		/* bytes of the image received so far */
+
+/*
+	apply_staged_config - the whole image is in: it replaces the settings
+		(the ISRs read them, so all at once) and is saved. The image includes
+		the calibration points, so the note tables are rebuilt too.
+*/
+bool apply_staged_config()
+{
+	for (uint8_t i = 0; i < CONFIG_PARTS; i++)
+	{
+		if (!staged_parts[i]->valid())
+		{
+			return false;
+		}
+	}
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		mctl.settings = staged_settings;
+		mctl.cv_out_a.settings = staged_cv_a;
+		mctl.cv_out_b.settings = staged_cv_b;
+		mctl.mod.settings = staged_mod;
+	}
+	
+	save_config(mctl);
+	load_note_tables(mctl);
+	mctl.build_step_table();
+	return true;
+}
+
+/*
+	receive_config - stages one uploaded chunk of the settings image (see
+		SysexConfigData). Chunks have to come in order from 0 and carry our
+		version; anything else, or an image that doesn't validate, drops the
+		upload and leaves the settings as they were.
+*/
+bool receive_config(uint8_t size)
+{
+	size_t image_size = config_size(mctl) - 1;
+	uint8_t first = sysex_args[1];
+	uint8_t count = size - 2;
+	if (size < 2 || size > SYSEX_ARGS_MAX || sysex_args[0] != CONFIG_VERSION ||
+		first != staged_size || first + count > image_size)
+	{
+		staged_size = 0;
+		return false;
+	}
+	
+	for (uint8_t i = 0; i < count; i++)
+	{
+		*image_byte(staged_parts, first + i) = sysex_args[2 + i];
+	}
+	staged_size += count;
+	
+	if (staged_size < image_size)
+	{
+		return true;
+	}
+	
+	staged_size = 0;
+	return apply_staged_config();
+}
+
+/*
+	send_task_stats - replies with the idle time and the worst case execution
+		time and deadline misses of every task, optionally clearing them
+*/
+void send_task_stats(bool clear)
+{
+	uint8_t msg[2 + 4 * (sizeof(tasks) / sizeof(tasks[0]))];
+	uint8_t offset = 0;
+	
+	msg[offset++] = idle_permille & 0xFF;
+	msg[offset++] = idle_permille >> 8;
+	for (uint8_t i = 0; i < scheduler.size(); i++)
+	{
+		const Task& t = scheduler.task(i);
+		msg[offset++] = t.wcet_us & 0xFF;
+		msg[offset++] = t.wcet_us >> 8;
+		msg[offset++] = t.misses & 0xFF;
+		msg[offset++] = t.misses >> 8;
+	}
+	
+	mctl.send_sysex(SysexTaskStatsData, msg, sizeof(msg));
+	
+	if (clear)
+		scheduler.clear_stats();
+}
+
+/*
+	send_histogram - replies with one of the timing histograms, optionally
+		clearing it
+*/
+void send_histogram(uint8_t id, bool clear)
+{
+	if (id >= NUM_HISTOGRAMS)
+		return;
+	
+	Histogram& hist = mctl.histograms[id];
+	uint8_t msg[1 + 2 * HIST_BUCKETS];
+	msg[0] = id;
+	for (uint8_t i = 0; i < HIST_BUCKETS; i++)
+	{
+		msg[1 + 2 * i] = hist.counts[i] & 0xFF;
+		msg[2 + 2 * i] = hist.counts[i] >> 8;
+	}
+	
+	mctl.send_sysex(SysexHistogramData, msg, sizeof(msg));
+	
+	if (clear)
+		hist.clear();
+}
+
+void send_buffer_stats(bool clear)
+{
+	uint8_t msg[5 * 4];
+	uint8_t len = mctl.buffer_stats(msg, clear);
+	
+	mctl.send_sysex(SysexBufferStatsData, msg, len);
+}
+
+void send_memory_stats()
+{
+	uint16_t static_used = static_ram_used();
+	uint8_t msg[5] = {
+		(uint8_t) (static_used & 0xFF), (uint8_t) (static_used >> 8),
+		(uint8_t) (stack_free & 0xFF), (uint8_t) (stack_free >> 8),
+		stack_low,
+	};
+	
+	mctl.send_sysex(SysexMemoryStatsData, msg, sizeof(msg));
+}
+
+#ifdef ENABLE_ISR_PROFILE
+/*
+	send_isr_stats - replies with min/max/average run time (us) and run count
+		of every profiled ISR and the Rx overrun count
+*/
+void send_isr_stats(bool clear)
+{
+	uint8_t msg[8 * NUM_PROFILED_ISRS + 2];
+	uint8_t offset = 0;
+	
+	for (uint8_t i = 0; i < NUM_PROFILED_ISRS; i++)
+	{
+		IsrStats s;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			s = isr_stats[i];
+		}
+		
+		uint16_t values[4] = {
+			(uint16_t) (s.count ? s.min_ticks * TIME_TICK_US : 0),
+			(uint16_t) (s.max_ticks * TIME_TICK_US),
+			(uint16_t) (s.count ? s.total_ticks * TIME_TICK_US / s.count : 0),
+			s.count,
+		};
+		for (uint8_t j = 0; j < 4; j++)
+		{
+			msg[offset++] = values[j] & 0xFF;
+			msg[offset++] = values[j] >> 8;
+		}
+	}
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		msg[offset++] = rx_overruns & 0xFF;
+		msg[offset++] = rx_overruns >> 8;
+	}
+	
+	mctl.send_sysex(SysexIsrStatsData, msg, sizeof(msg));
+	
+	if (clear)
+		isr_profile_clear();
+}
+#endif
+
+void sysex_reply(uint8_t command, bool ok)
+{
+	mctl.send_sysex(ok ? SysexAck : SysexNak, &command, 1);
+}
+
+/*
+	sysex_byte - every data byte of a SysEx message as it's unpacked
+*/
+void sysex_byte(uint8_t command, uint8_t idx, uint8_t value)
+{
+	(void) command;
+	if (idx < SYSEX_ARGS_MAX)
+	{
+		sysex_args[idx] = value;
+	}
+}
+
+void handleSysEx(uint8_t command, uint8_t size, bool ok)
+{
+	TRACE_SCOPE(DISPATCH);
+	if (!ok)
+	{
+		// bad checksum or cut short: no reply, and a config upload starts over
+		if (command == SysexConfigData)
+		{
+			staged_size = 0;
+		}
+		return;
+	}
+	
+	uint8_t* data = sysex_args;
+	switch (command)
+	{
+		case SysexNoteOffsetsRequest:
+			if (size == 1)
+				send_note_offsets(data[0]);
+			break;
+		
+		case SysexNoteOffsetsData:
+			sysex_reply(command, receive_note_offsets(size));
+			break;
+		
+		case SysexConfigRequest:
+			send_config();
+			break;
+		
+		case SysexConfigData:
+			sysex_reply(command, receive_config(size));
+			break;
+		
+		case SysexTaskStatsRequest:
+			send_task_stats(size == 1 && data[0]);
+			break;
+		
+		case SysexBufferStatsRequest:
+			send_buffer_stats(size == 1 && data[0]);
+			break;
+		
+		case SysexMemoryStatsRequest:
+			send_memory_stats();
+			break;
+		
+#ifdef ENABLE_ISR_PROFILE
+		case SysexIsrStatsRequest:
+			send_isr_stats(size == 1 && data[0]);
+			break;
+#endif
+		
+		case SysexHistogramRequest:
+			if (size >= 1)
+				send_histogram(data[0], size == 2 && data[1]);
+			break;
+		
+		default:
+			break;
+	}
+}
+
 /**************************************************/
 /*  INTERRUPTS: TIMERS, MIDI Rx, MIDI Tx ready    */
 /**************************************************/
 
+// switch edges only need to wake the main loop, see idle()
+ISR(PCINT1_vect) {
+	wake_loop = true;
+}
+
+ISR(PCINT2_vect) {
+	wake_loop = true;
+}
+
 // MIDI Rx message - there is a new byte in the data register
 ISR(USART_RX_vect) {
+	ISR_PROFILE_BEGIN();
+	ISR_PROFILE_RX_OVERRUN(); // must be checked before UDR0 is read
 	uint8_t latest_byte = UDR0;
 	mctl.incoming_message(latest_byte);
+	wake_loop = true;
+	ISR_PROFILE_END(IsrUsartRx);
 }
 
+#ifdef ENABLE_MIDI_OUTPUT
+// MIDI Tx ready - the data register is empty, send the next queued byte
+ISR(USART_UDRE_vect) {
+	ISR_PROFILE_BEGIN();
+	mctl.tx_ready();
+	ISR_PROFILE_END(IsrUsartUdre);
+}
+#endif
+
 // measured frequency of LED toggle = 94.7 kHz (on the DMM)
 ISR(TIMER2_COMPA_vect) {
+	ISR_PROFILE_BEGIN();
 	mctl.time_inc();
+	mctl.mod.update();	// on the tick, so LFO rates don't depend on how busy the loop is
+	wake_loop = true;
+	ISR_PROFILE_END(IsrTimer2CompA);
+}
+
+// end of a VEL PWM period, only enabled while an output is dithering (see update_dither)
+volatile uint8_t dither_countdown = VEL_DITHER_PERIODS;
+ISR(TIMER0_OVF_vect) {
+	if (--dither_countdown)
+	{
+		return;
+	}
+	dither_countdown = VEL_DITHER_PERIODS;
+	
+	ISR_PROFILE_BEGIN();
+	mctl.cv_out_a.dither_velocity();
+	mctl.cv_out_b.dither_velocity();
+	ISR_PROFILE_END(IsrTimer0Ovf);
+}
+
+// the next edge of a KCS pulse burst
+ISR(TIMER2_COMPB_vect) {
+	ISR_PROFILE_BEGIN();
+	mctl.adv_burst_edge();
+	ISR_PROFILE_END(IsrTimer2CompB);
 }
 
 ISR(TIMER1_COMPA_vect) {
+	ISR_PROFILE_BEGIN();
 	clear_bit(TRIG_PORT, TRIG_A_OUT);
 	leda_off();
 	DISABLE_OCI1A();
+	ISR_PROFILE_END(IsrTimer1CompA);
 }
 
 ISR(TIMER1_COMPB_vect) {
+	ISR_PROFILE_BEGIN();
 	clear_bit(TRIG_PORT, TRIG_B_OUT);
 	ledb_off();
 	DISABLE_OCI1B();
+	ISR_PROFILE_END(IsrTimer1CompB);
 }
 
 
 void handleNoteOn(byte ch, byte pitch, byte vel) 
 {
+	TRACE_SCOPE(DISPATCH);
 	switch (mode)
 	{
 		case LearnChannel:
@@ -284,13 +810,15 @@ void handleNoteOn(byte ch, byte pitch, byte vel)
 	}
 }
 
-void handleCC(byte ch, byte cc_num, byte cc_val) { mctl.handleCC(ch, cc_num, cc_val); }
-void handleNoteOff(byte ch, byte pitch, byte vel) { mctl.handleNoteOff(ch, pitch, vel); }
-void handleStart()						{ mctl.handleStart(); }
-void handleStop()						{ mctl.handleStop(); }
-void handleClock()						{ mctl.handleClock(); }
-void handleContinue()					{ mctl.handleContinue(); }
-void handlePitchBend(byte ch, int amt)	{ mctl.handlePitchBend(ch, amt); }
+void handleCC(byte ch, byte cc_num, byte cc_val) { TRACE_SCOPE(DISPATCH); mctl.handleCC(ch, cc_num, cc_val); }
+void handleNoteOff(byte ch, byte pitch, byte vel) { TRACE_SCOPE(DISPATCH); mctl.handleNoteOff(ch, pitch, vel); }
+void handleStart()						{ TRACE_SCOPE(DISPATCH); mctl.handleStart(); }
+void handleStop()						{ TRACE_SCOPE(DISPATCH); mctl.handleStop(); }
+void handleClock()						{ TRACE_SCOPE(DISPATCH); mctl.handleClock(); }
+void handleContinue()					{ TRACE_SCOPE(DISPATCH); mctl.handleContinue(); }
+void handlePitchBend(byte ch, int amt)	{ TRACE_SCOPE(DISPATCH); mctl.handlePitchBend(ch, amt); }
+void handleAfterTouchChannel(byte ch, byte pressure)		{ TRACE_SCOPE(DISPATCH); mctl.handleAfterTouchChannel(ch, pressure); }
+void handleAfterTouchPoly(byte ch, byte note, byte pressure)	{ TRACE_SCOPE(DISPATCH); mctl.handleAfterTouchPoly(ch, note, pressure); }
 	
 void register_midi_events()
 {
@@ -302,6 +830,9 @@ void register_midi_events()
 	mctl.midi.setHandleContinue(handleContinue);
 	mctl.midi.setHandlePitchBend(handlePitchBend);
 	mctl.midi.setHandleNoteOff(handleNoteOff);
+	mctl.midi.setHandleAfterTouchChannel(handleAfterTouchChannel);
+	mctl.midi.setHandleAfterTouchPoly(handleAfterTouchPoly);
+	mctl.setHandleSysEx(sysex_byte, handleSysEx);
 }
 
 void unregister_midi_events()
@@ -314,4 +845,7 @@ void unregister_midi_events()
 	mctl.midi.setHandleContinue(nullptr);
 	mctl.midi.setHandlePitchBend(nullptr);
 	mctl.midi.setHandleNoteOff(nullptr);
+	mctl.midi.setHandleAfterTouchChannel(nullptr);
+	mctl.midi.setHandleAfterTouchPoly(nullptr);
+	mctl.setHandleSysEx(nullptr, nullptr);
 }
\ No newline at end of file
@@ -0,0 +1,8 @@
+/* avr/cpufunc.h (host) */
+
+#ifndef HOST_AVR_CPUFUNC_H_
+#define HOST_AVR_CPUFUNC_H_
+
+#define _NOP()
+
+#endif /* HOST_AVR_CPUFUNC_H_ */
@@ -0,0 +1,23 @@
+/* avr/eeprom.h (host): E2END + 1 bytes of RAM, erased (0xFF) at start */
+
+#ifndef HOST_AVR_EEPROM_H_
+#define HOST_AVR_EEPROM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EEMEM
+
+/* writes are done at once here */
+#define eeprom_is_ready() 1
+
+uint8_t eeprom_read_byte(const uint8_t* addr);
+void eeprom_write_byte(uint8_t* addr, uint8_t value);
+void eeprom_update_byte(uint8_t* addr, uint8_t value);
+uint16_t eeprom_read_word(const uint16_t* addr);
+void eeprom_update_word(uint16_t* addr, uint16_t value);
+void eeprom_read_block(void* dst, const void* addr, size_t size);
+void eeprom_write_block(const void* src, void* addr, size_t size);
+void eeprom_update_block(const void* src, void* addr, size_t size);
+
+#endif /* HOST_AVR_EEPROM_H_ */
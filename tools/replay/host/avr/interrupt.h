@@ -0,0 +1,21 @@
+/*
+ * avr/interrupt.h (host)
+ *
+ * ISRs become plain functions the harness calls when the simulated
+ * peripheral would raise them.
+ */ 
+
+#ifndef HOST_AVR_INTERRUPT_H_
+#define HOST_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+#define ISR(vector, ...)		extern "C" void vector(void); extern "C" void vector(void)
+#define EMPTY_INTERRUPT(vector)	extern "C" void vector(void) { }
+#define ISR_NOBLOCK
+#define ISR_NAKED
+
+inline void cli() { SREG.value &= ~_BV(SREG_I); }
+inline void sei() { SREG.value |= _BV(SREG_I); }
+
+#endif /* HOST_AVR_INTERRUPT_H_ */
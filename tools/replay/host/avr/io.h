@@ -0,0 +1,107 @@
+/*
+ * avr/io.h (host)
+ *
+ * ATmega328 registers for the replay harness. Each register is a HostReg
+ * object: reads return its value and every write is reported to
+ * host_reg_write() so the harness can watch the pins and the SPI/USART
+ * data registers. The harness sets counter and input values directly
+ * through .value, which isn't reported.
+ */ 
+
+#ifndef HOST_AVR_IO_H_
+#define HOST_AVR_IO_H_
+
+#include <stdint.h>
+#include <avr/sfr_defs.h>
+
+void host_reg_write(const void* reg, uint16_t old_value, uint16_t new_value);
+
+template <typename T>
+class HostReg
+{
+public:
+	volatile T value;
+	
+	HostReg() : value(0) { }
+	operator T() const { return value; }
+	
+	HostReg& operator=(T v)
+	{
+		T old = value;
+		value = v;
+		host_reg_write(this, old, v);
+		return *this;
+	}
+	HostReg& operator=(const HostReg& r) { return *this = (T) r.value; }
+	HostReg& operator|=(int v) { return *this = (T) (value | v); }
+	HostReg& operator&=(int v) { return *this = (T) (value & v); }
+	HostReg& operator^=(int v) { return *this = (T) (value ^ v); }
+};
+
+#define HOST_REGS8(X)												\
+	X(PINB) X(DDRB) X(PORTB) X(PINC) X(DDRC) X(PORTC)				\
+	X(PIND) X(DDRD) X(PORTD) X(TIFR0) X(TIFR1) X(TIFR2)				\
+	X(GPIOR0) X(EIMSK) X(TCCR0A) X(TCCR0B) X(TCNT0) X(OCR0A)		\
+	X(OCR0B) X(GPIOR1) X(GPIOR2) X(SPCR) X(SPSR) X(SPDR)			\
+	X(SMCR) X(MCUSR) X(MCUCR) X(SREG) X(WDTCSR) X(PRR)				\
+	X(PCICR) X(EICRA) X(PCMSK0) X(PCMSK1) X(PCMSK2) X(TIMSK0)		\
+	X(TIMSK1) X(TIMSK2) X(ADCL) X(ADCH) X(ADCSRA) X(ADCSRB)			\
+	X(ADMUX) X(DIDR0) X(TCCR1A) X(TCCR1B) X(TCCR1C) X(TCCR2A)		\
+	X(TCCR2B) X(TCNT2) X(OCR2A) X(OCR2B) X(ASSR) X(GTCCR)			\
+	X(UCSR0A) X(UCSR0B) X(UCSR0C) X(UBRR0L) X(UBRR0H) X(UDR0)
+
+#define HOST_REGS16(X)												\
+	X(SP) X(ADC) X(TCNT1) X(ICR1) X(OCR1A) X(OCR1B)
+
+#define HOST_DECLARE8(name)		extern HostReg<uint8_t> name;
+#define HOST_DECLARE16(name)	extern HostReg<uint16_t> name;
+HOST_REGS8(HOST_DECLARE8)
+HOST_REGS16(HOST_DECLARE16)
+
+#define ADCW ADC
+
+#define RAMSTART	0x100
+#define RAMEND		0x8FF
+#define E2END		0x3FF
+
+enum { PB0, PB1, PB2, PB3, PB4, PB5, PB6, PB7 };
+enum { PORTB0, PORTB1, PORTB2, PORTB3, PORTB4, PORTB5, PORTB6, PORTB7 };
+enum { PORTC0, PORTC1, PORTC2, PORTC3, PORTC4, PORTC5, PORTC6 };
+enum { PORTD0, PORTD1, PORTD2, PORTD3, PORTD4, PORTD5, PORTD6, PORTD7 };
+enum { PINB0, PINB1, PINB2, PINB3, PINB4, PINB5, PINB6, PINB7 };
+enum { PINC0, PINC1, PINC2, PINC3, PINC4, PINC5, PINC6 };
+enum { PIND0, PIND1, PIND2, PIND3, PIND4, PIND5, PIND6, PIND7 };
+enum { DDB0, DDB1, DDB2, DDB3, DDB4, DDB5, DDB6, DDB7 };
+enum { DDC0, DDC1, DDC2, DDC3, DDC4, DDC5, DDC6 };
+enum { DDD0, DDD1, DDD2, DDD3, DDD4, DDD5, DDD6, DDD7 };
+enum { PC0, PC1, PC2, PC3, PC4, PC5, PC6 };
+enum { PD0, PD1, PD2, PD3, PD4, PD5, PD6, PD7 };
+enum { WGM00 = 0, WGM01 = 1, COM0B0 = 4, COM0B1 = 5, COM0A0 = 6, COM0A1 = 7 };
+enum { CS00 = 0, CS01 = 1, CS02 = 2, WGM02 = 3 };
+enum { TOIE0 = 0, OCIE0A = 1, OCIE0B = 2 };
+enum { TOV0 = 0, OCF0A = 1, OCF0B = 2 };
+enum { WGM10 = 0, WGM11 = 1, COM1B0 = 4, COM1B1 = 5, COM1A0 = 6, COM1A1 = 7 };
+enum { CS10 = 0, CS11 = 1, CS12 = 2, WGM12 = 3, WGM13 = 4, ICES1 = 6, ICNC1 = 7 };
+enum { TOIE1 = 0, OCIE1A = 1, OCIE1B = 2, ICIE1 = 5 };
+enum { TOV1 = 0, OCF1A = 1, OCF1B = 2, ICF1 = 5 };
+enum { WGM20 = 0, WGM21 = 1, COM2B0 = 4, COM2B1 = 5, COM2A0 = 6, COM2A1 = 7 };
+enum { CS20 = 0, CS21 = 1, CS22 = 2, WGM22 = 3 };
+enum { TOIE2 = 0, OCIE2A = 1, OCIE2B = 2 };
+enum { TOV2 = 0, OCF2A = 1, OCF2B = 2 };
+enum { PSRSYNC = 0, PSRASY = 1, TSM = 7 };
+enum { MPCM0 = 0, U2X0 = 1, UPE0 = 2, DOR0 = 3, FE0 = 4, UDRE0 = 5, TXC0 = 6, RXC0 = 7 };
+enum { TXB80 = 0, RXB80 = 1, UCSZ02 = 2, TXEN0 = 3, RXEN0 = 4, UDRIE0 = 5, TXCIE0 = 6, RXCIE0 = 7 };
+enum { UCPOL0 = 0, UCSZ00 = 1, UCSZ01 = 2, USBS0 = 3, UPM00 = 4, UPM01 = 5, UMSEL00 = 6, UMSEL01 = 7 };
+enum { SPR0 = 0, SPR1 = 1, CPHA = 2, CPOL = 3, MSTR = 4, DORD = 5, SPE = 6, SPIE = 7 };
+enum { SPI2X = 0, WCOL = 6, SPIF = 7 };
+enum { ADPS0 = 0, ADPS1 = 1, ADPS2 = 2, ADIE = 3, ADIF = 4, ADATE = 5, ADSC = 6, ADEN = 7 };
+enum { MUX0 = 0, MUX1 = 1, MUX2 = 2, MUX3 = 3, ADLAR = 5, REFS0 = 6, REFS1 = 7 };
+enum { ADC0D = 0, ADC1D, ADC2D, ADC3D, ADC4D, ADC5D };
+enum { SE = 0, SM0 = 1, SM1 = 2, SM2 = 3 };
+enum { PCIE0 = 0, PCIE1 = 1, PCIE2 = 2 };
+enum { PCINT0 = 0, PCINT1, PCINT2, PCINT3, PCINT4, PCINT5, PCINT6, PCINT7 };
+enum { PCINT8 = 0, PCINT9, PCINT10, PCINT11, PCINT12, PCINT13, PCINT14 };
+enum { PCINT16 = 0, PCINT17, PCINT18, PCINT19, PCINT20, PCINT21, PCINT22, PCINT23 };
+enum { SREG_C = 0, SREG_Z, SREG_N, SREG_V, SREG_S, SREG_H, SREG_T, SREG_I };
+
+#endif /* HOST_AVR_IO_H_ */
@@ -0,0 +1,11 @@
+/* avr/sfr_defs.h (host) */
+
+#ifndef HOST_AVR_SFR_DEFS_H_
+#define HOST_AVR_SFR_DEFS_H_
+
+#define _BV(bit)				(1 << (bit))
+#define _SFR_BYTE(sfr)			(sfr)
+#define bit_is_set(sfr, bit)	((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit)	(!((sfr) & _BV(bit)))
+
+#endif /* HOST_AVR_SFR_DEFS_H_ */
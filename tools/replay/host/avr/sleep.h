@@ -0,0 +1,12 @@
+/* avr/sleep.h (host): the harness runs the loop once per interrupt instead */
+
+#ifndef HOST_AVR_SLEEP_H_
+#define HOST_AVR_SLEEP_H_
+
+#define SLEEP_MODE_IDLE		0
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu()
+
+#endif /* HOST_AVR_SLEEP_H_ */
@@ -0,0 +1,55 @@
+/*
+ * host_avr.cpp
+ *
+ * Storage for the host register and EEPROM stand-ins.
+ */ 
+
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+
+#define HOST_DEFINE8(name)		HostReg<uint8_t> name;
+#define HOST_DEFINE16(name)		HostReg<uint16_t> name;
+HOST_REGS8(HOST_DEFINE8)
+HOST_REGS16(HOST_DEFINE16)
+
+static uint8_t eeprom[E2END + 1];
+static struct EepromInit { EepromInit() { memset(eeprom, 0xFF, sizeof(eeprom)); } } eeprom_init;
+
+static size_t eeprom_offset(const void* addr)
+{
+	return (size_t) addr % sizeof(eeprom);
+}
+
+uint8_t eeprom_read_byte(const uint8_t* addr)			{ return eeprom[eeprom_offset(addr)]; }
+void eeprom_write_byte(uint8_t* addr, uint8_t value)	{ eeprom[eeprom_offset(addr)] = value; }
+void eeprom_update_byte(uint8_t* addr, uint8_t value)	{ eeprom[eeprom_offset(addr)] = value; }
+
+uint16_t eeprom_read_word(const uint16_t* addr)
+{
+	return eeprom_read_byte((const uint8_t*) addr) | (eeprom_read_byte((const uint8_t*) addr + 1) << 8);
+}
+
+void eeprom_update_word(uint16_t* addr, uint16_t value)
+{
+	eeprom_update_byte((uint8_t*) addr, value & 0xFF);
+	eeprom_update_byte((uint8_t*) addr + 1, value >> 8);
+}
+
+void eeprom_read_block(void* dst, const void* addr, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		((uint8_t*) dst)[i] = eeprom_read_byte((const uint8_t*) addr + i);
+}
+
+void eeprom_write_block(const void* src, void* addr, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+		eeprom_write_byte((uint8_t*) addr + i, ((const uint8_t*) src)[i]);
+}
+
+void eeprom_update_block(const void* src, void* addr, size_t size)
+{
+	eeprom_write_block(src, addr, size);
+}
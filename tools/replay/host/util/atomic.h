@@ -0,0 +1,10 @@
+/* util/atomic.h (host): ISRs only run between firmware calls, so blocks are just blocks */
+
+#ifndef HOST_UTIL_ATOMIC_H_
+#define HOST_UTIL_ATOMIC_H_
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type)	for (bool atomic_once = true; atomic_once; atomic_once = false)
+
+#endif /* HOST_UTIL_ATOMIC_H_ */
@@ -0,0 +1,9 @@
+/* util/delay.h (host): busy waits take no simulated time */
+
+#ifndef HOST_UTIL_DELAY_H_
+#define HOST_UTIL_DELAY_H_
+
+inline void _delay_ms(double) { }
+inline void _delay_us(double) { }
+
+#endif /* HOST_UTIL_DELAY_H_ */
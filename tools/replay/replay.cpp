@@ -0,0 +1,705 @@
+/*
+ * replay.cpp
+ *
+ * Host replay harness. The firmware is compiled for the PC against the
+ * register stand-ins in host/, a MIDI capture is played into the USART Rx
+ * interrupt in simulated time, and what the outputs did is written out,
+ * one line per event:
+ *
+ *	<time us> DAC <channel> <code>		DAC writes that changed the code
+ *	<time us> TRIG <A|B> <0|1>			trigger edges
+ *	<time us> ADV <0|1>					ADV/CLOCK edges
+ *	<time us> VEL <A|B> <duty>			velocity PWM changes
+ *	<time us> TX <byte>					MIDI out (ENABLE_MIDI_OUTPUT builds)
+ *
+ * Given a golden trace the output is compared with it instead, and the
+ * exit status is 1 at the first difference. Golden traces have to come
+ * from this harness: the PC does double math in 64 bits where avr-gcc
+ * uses 32, so a code can be off by one from the hardware. Use simavr to
+ * compare with the real target.
+ *
+ * Time only moves between calls into the firmware, in 4us Timer1/Timer2
+ * ticks. After the interrupts that wake the main loop (the Timer2 tick and
+ * received bytes, see idle()) the scheduler is run until no parsed MIDI is
+ * waiting, which is what the loop does before it sleeps again, and while
+ * received bytes wait for their release it's run on every tick: the loop
+ * doesn't sleep then. The other interrupts only run their ISR.
+ *
+ * Build from the repository root:
+ *
+ *	g++ -std=gnu++11 -O2 -funsigned-char -fshort-enums -DF_CPU=16000000UL \
+ *		-Dmain=firmware_main -Itools/replay/host \
+ *		$(ls *.cpp | grep -v StackMonitor) lib/MIDI.cpp tools/replay/replay.cpp \
+ *		tools/replay/host/host_avr.cpp -o replay
+ *
+ * Usage:
+ *
+ *	replay [-o trace] [-g golden] [-t tail ms] [-k] [-b] <capture>
+ *	replay --gen chords|pbsweep|clock300|kcsjumps > capture.txt
+ *
+ * A capture is a standard MIDI file (.mid) or text with one
+ * "<time us> <hex bytes ...>" line per message ('#' starts a comment).
+ * -k starts with the mode switch in the KCS position.
+ * -b prints the KCS jump benchmark instead of the trace: for every NoteOn
+ * on the KCS channel, the ADV pulses it sent and when the first and the
+ * last of them rose, counted from the NoteOn's last byte. The kcsjumps
+ * capture (-k) jumps every distance from 1 to 8 steps once.
+ *
+ * golden/ has the --gen captures and their traces from the firmware as it
+ * is. Run them after every change to CvOutput or MidiController, and
+ * regenerate them (-o) only when the output was meant to change.
+ */
+
+#undef main
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "../../GPIO.h"
+#include "../../MidiController.h"
+#include "../../Scheduler.h"
+
+#define BYTE_TIME_US	320		/* 10 bits at 31250 baud */
+#define TICK_US			4
+#define PWM_PERIOD_US	16		/* Timer0 fast PWM, no prescaler */
+
+/* from main.cpp */
+extern MidiController mctl;
+extern Scheduler scheduler;
+int firmware_main();
+void register_midi_events();
+bool load_config(MidiController& mctl);
+void save_config(MidiController& mctl);
+void load_note_tables(MidiController& mctl);
+
+extern "C" void USART_RX_vect(void);
+extern "C" void USART_UDRE_vect(void) __attribute__ ((weak));
+extern "C" void TIMER1_COMPA_vect(void);
+extern "C" void TIMER1_COMPB_vect(void);
+extern "C" void TIMER2_COMPA_vect(void);
+extern "C" void TIMER2_COMPB_vect(void) __attribute__ ((weak));
+extern "C" void TIMER0_OVF_vect(void) __attribute__ ((weak));
+
+/* StackMonitor.cpp is AVR assembly, there's no stack to watch here */
+uint16_t stack_unused() { return 0xFFFF; }
+uint16_t static_ram_used() { return 0; }
+
+struct TimedByte
+{
+	uint32_t us;
+	uint8_t data;
+};
+
+static uint32_t sim_us;
+static uint32_t tx_free_us;
+static std::vector<std::string> trace;
+
+static uint8_t spi_bytes[2];
+static uint8_t spi_count;
+static int dac_codes[2] = {-1, -1};
+
+
+/************************************************************************/
+/*		OUTPUT WATCHING                                                 */
+/************************************************************************/
+static void record(const char* fmt, ...) __attribute__ ((format(printf, 1, 2)));
+
+static void record(const char* fmt, ...)
+{
+	char line[64];
+	int len = snprintf(line, sizeof(line), "%u ", (unsigned) sim_us);
+
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(line + len, sizeof(line) - len, fmt, args);
+	va_end(args);
+
+	trace.push_back(line);
+}
+
+static bool rose(uint16_t old_value, uint16_t new_value, uint8_t bit)
+{
+	return !(old_value & _BV(bit)) && (new_value & _BV(bit));
+}
+
+static bool changed(uint16_t old_value, uint16_t new_value, uint8_t bit)
+{
+	return (old_value ^ new_value) & _BV(bit);
+}
+
+void host_reg_write(const void* reg, uint16_t old_value, uint16_t new_value)
+{
+	if (reg == &SPDR)
+	{
+		if (spi_count < 2)
+			spi_bytes[spi_count++] = new_value;
+		SPSR.value |= _BV(SPIF); // the transfer is done as soon as it starts
+	}
+	else if (reg == &DAC_CS_PORT)
+	{
+		if (changed(old_value, new_value, DAC_CS) && !(new_value & _BV(DAC_CS)))
+		{
+			spi_count = 0;
+		}
+		else if (rose(old_value, new_value, DAC_CS) && spi_count == 2)
+		{
+			uint8_t ch = spi_bytes[0] >> 7;
+			int code = ((spi_bytes[0] & 0x0F) << 8) | spi_bytes[1];
+			if (code != dac_codes[ch])
+			{
+				dac_codes[ch] = code;
+				record("DAC %u %d", ch, code);
+			}
+		}
+
+		if (changed(old_value, new_value, ADV_OUT))
+			record("ADV %u", !!(new_value & _BV(ADV_OUT)));
+	}
+	else if (reg == &TRIG_PORT)
+	{
+		if (changed(old_value, new_value, TRIG_A_OUT))
+			record("TRIG A %u", !!(new_value & _BV(TRIG_A_OUT)));
+		if (changed(old_value, new_value, TRIG_B_OUT))
+			record("TRIG B %u", !!(new_value & _BV(TRIG_B_OUT)));
+	}
+	else if (reg == &VEL_A_DUTY && old_value != new_value)
+	{
+		record("VEL A %u", new_value);
+	}
+	else if (reg == &VEL_B_DUTY && old_value != new_value)
+	{
+		record("VEL B %u", new_value);
+	}
+	else if (reg == &UDR0)
+	{
+		record("TX %02X", new_value);
+		tx_free_us = sim_us + BYTE_TIME_US;
+		UCSR0A.value &= ~_BV(UDRE0);
+	}
+}
+
+
+/************************************************************************/
+/*		SIMULATION                                                      */
+/************************************************************************/
+static void call_isr(void (*isr)())
+{
+	SREG.value &= ~_BV(SREG_I);
+	isr();
+	SREG.value |= _BV(SREG_I);
+}
+
+/*
+	run_loop - what the main loop does between two interrupts
+*/
+static void run_loop()
+{
+	do
+	{
+		scheduler.run();
+	} while (mctl.midi_pending());
+}
+
+/*
+	start_firmware - main() up to its loop. The EEPROM starts erased, so
+		this is a unit with the default settings.
+*/
+static void start_firmware(bool kcs)
+{
+	PINB.value = 0xFF;
+	PINC.value = 0xFF; // switches read high when they're not pressed
+	PIND.value = kcs ? ~_BV(MODE_SWITCH) : 0xFF;
+	SPSR.value = _BV(SPIF);
+	UCSR0A.value = _BV(UDRE0);
+
+	cli();
+	mctl.midi.turnThruOff();
+	hardware_init();
+
+	if (!load_config(mctl))
+		save_config(mctl);
+
+	load_note_tables(mctl);
+	mctl.build_step_table();
+	register_midi_events();
+	sei();
+
+	scheduler.start();
+}
+
+/*
+	tick - moves simulated time on by one 4us tick and raises the interrupts
+		that happen on it
+*/
+static void tick()
+{
+	sim_us += TICK_US;
+
+	TCNT1.value++;
+	if ((TIMSK1 & _BV(OCIE1A)) && TCNT1.value == OCR1A.value)
+	{
+		call_isr(TIMER1_COMPA_vect);
+	}
+	if ((TIMSK1 & _BV(OCIE1B)) && TCNT1.value == OCR1B.value)
+	{
+		call_isr(TIMER1_COMPB_vect);
+	}
+
+	TCNT2.value = TCNT2.value == OCR2A.value ? 0 : TCNT2.value + 1;
+	if (TIMER2_COMPB_vect && (TIMSK2 & _BV(OCIE2B)) && TCNT2.value == OCR2B.value)
+	{
+		call_isr(TIMER2_COMPB_vect);
+	}
+	if ((TIMSK2 & _BV(OCIE2A)) && TCNT2.value == OCR2A.value)
+	{
+		call_isr(TIMER2_COMPA_vect);
+		run_loop();
+	}
+
+	if (TIMER0_OVF_vect && (TIMSK0 & _BV(TOIE0)) && sim_us % PWM_PERIOD_US == 0)
+	{
+		call_isr(TIMER0_OVF_vect);
+	}
+
+	if ((int32_t) (sim_us - tx_free_us) >= 0)
+	{
+		UCSR0A.value |= _BV(UDRE0);
+		if (USART_UDRE_vect && (UCSR0B & _BV(UDRIE0)))
+		{
+			call_isr(USART_UDRE_vect);
+		}
+	}
+
+	if (mctl.midi_buffered())
+	{
+		run_loop(); // idle() spins until the bytes are released
+	}
+}
+
+static void simulate(const std::vector<TimedByte>& bytes, uint32_t tail_us, bool kcs)
+{
+	start_firmware(kcs);
+
+	uint32_t end_us = (bytes.empty() ? 0 : bytes.back().us) + tail_us;
+	size_t next = 0;
+	while (sim_us < end_us)
+	{
+		while (next < bytes.size() && bytes[next].us <= sim_us)
+		{
+			UDR0.value = bytes[next++].data;
+			if (UCSR0B & _BV(RXCIE0))
+			{
+				call_isr(USART_RX_vect);
+				run_loop();
+			}
+		}
+		tick();
+	}
+}
+
+
+/************************************************************************/
+/*		CAPTURES                                                        */
+/************************************************************************/
+static bool read_file(const char* path, std::vector<uint8_t>& data)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in)
+		return false;
+	data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	return true;
+}
+
+/*
+	add_message - queues a message no earlier than US, and no earlier than the
+		wire allows after the bytes before it
+*/
+static void add_message(std::vector<TimedByte>& bytes, uint32_t us, const std::vector<uint8_t>& msg)
+{
+	for (uint8_t b : msg)
+	{
+		if (!bytes.empty() && us < bytes.back().us + BYTE_TIME_US)
+			us = bytes.back().us + BYTE_TIME_US;
+		bytes.push_back({us, b});
+	}
+}
+
+static bool load_text(const char* path, std::vector<TimedByte>& bytes)
+{
+	std::ifstream in(path);
+	if (!in)
+		return false;
+
+	std::string line;
+	while (std::getline(in, line))
+	{
+		line = line.substr(0, line.find('#'));
+		std::istringstream fields(line);
+
+		unsigned long us;
+		if (!(fields >> us))
+			continue;
+
+		std::vector<uint8_t> msg;
+		std::string hex;
+		while (fields >> hex)
+			msg.push_back(strtoul(hex.c_str(), nullptr, 16));
+		add_message(bytes, us, msg);
+	}
+	return true;
+}
+
+struct SmfEvent
+{
+	uint32_t tick;
+	uint16_t track;
+	uint32_t seq;
+	uint32_t tempo;				/* set for tempo changes, which have no bytes */
+	std::vector<uint8_t> msg;
+};
+
+static uint32_t read_vlq(const std::vector<uint8_t>& d, size_t& i, size_t end)
+{
+	uint32_t value = 0;
+	while (i < end)
+	{
+		uint8_t b = d[i++];
+		value = (value << 7) | (b & 0x7F);
+		if (!(b & 0x80))
+			break;
+	}
+	return value;
+}
+
+static uint32_t read_be(const std::vector<uint8_t>& d, size_t i, uint8_t len)
+{
+	uint32_t value = 0;
+	for (uint8_t n = 0; n < len; n++)
+		value = (value << 8) | d[i + n];
+	return value;
+}
+
+/*
+	load_smf - format 0 or 1 standard MIDI files with PPQN timing. All the
+		tracks are merged onto the one MIDI in.
+*/
+static bool load_smf(const char* path, std::vector<TimedByte>& bytes)
+{
+	std::vector<uint8_t> d;
+	if (!read_file(path, d) || d.size() < 14 || memcmp(&d[0], "MThd", 4))
+		return false;
+
+	uint16_t num_tracks = read_be(d, 10, 2);
+	uint16_t division = read_be(d, 12, 2);
+	if (division & 0x8000)
+	{
+		fprintf(stderr, "%s: SMPTE timing isn't supported\n", path);
+		return false;
+	}
+
+	std::vector<SmfEvent> events;
+	size_t pos = 8 + read_be(d, 4, 4);
+	for (uint16_t track = 0; track < num_tracks && pos + 8 <= d.size(); track++)
+	{
+		size_t end = std::min(d.size(), pos + 8 + read_be(d, pos + 4, 4));
+		bool is_track = !memcmp(&d[pos], "MTrk", 4);
+		size_t i = pos + 8;
+		pos = end;
+		if (!is_track)
+			continue;
+
+		uint32_t tick = 0;
+		uint8_t status = 0;
+		while (i < end)
+		{
+			tick += read_vlq(d, i, end);
+			if (i < end && (d[i] & 0x80))
+				status = d[i++];
+
+			SmfEvent ev = {tick, track, (uint32_t) events.size(), 0, {}};
+			if (status == 0xFF)
+			{
+				uint8_t type = i < end ? d[i++] : 0;
+				uint32_t len = read_vlq(d, i, end);
+				if (type == 0x51 && len == 3 && i + 3 <= end)
+				{
+					ev.tempo = read_be(d, i, 3);
+					events.push_back(ev);
+				}
+				i += len;
+				status = 0;
+			}
+			else if (status == 0xF0 || status == 0xF7)
+			{
+				uint32_t len = read_vlq(d, i, end);
+				if (status == 0xF0)
+					ev.msg.push_back(0xF0);
+				for (uint32_t n = 0; n < len && i < end; n++)
+					ev.msg.push_back(d[i++]);
+				events.push_back(ev);
+				status = 0;
+			}
+			else if (status & 0x80)
+			{
+				uint8_t type = status & 0xF0;
+				uint8_t len = type == 0xC0 || type == 0xD0 ? 1 : 2;
+				ev.msg.push_back(status);
+				for (uint8_t n = 0; n < len && i < end; n++)
+					ev.msg.push_back(d[i++]);
+				events.push_back(ev);
+			}
+			else
+			{
+				i++; // data byte without a status, skip it
+			}
+		}
+	}
+
+	std::stable_sort(events.begin(), events.end(), [](const SmfEvent& a, const SmfEvent& b) {
+		return a.tick != b.tick ? a.tick < b.tick : a.track < b.track;
+	});
+
+	uint32_t tempo = 500000; // 120 BPM until told otherwise
+	uint32_t last_tick = 0;
+	uint64_t elapsed = 0; // in us * division
+	for (const SmfEvent& ev : events)
+	{
+		elapsed += (uint64_t) (ev.tick - last_tick) * tempo;
+		last_tick = ev.tick;
+
+		if (ev.tempo)
+			tempo = ev.tempo;
+		else
+			add_message(bytes, elapsed / division, ev.msg);
+	}
+	return true;
+}
+
+static bool load_capture(const char* path, std::vector<TimedByte>& bytes)
+{
+	size_t len = strlen(path);
+	if (len > 4 && (!strcmp(path + len - 4, ".mid") || !strcmp(path + len - 4, ".MID")))
+		return load_smf(path, bytes);
+	return load_text(path, bytes);
+}
+
+/*
+	generate - prints one of the standard stress captures
+*/
+static bool generate(const char* name)
+{
+	if (!strcmp(name, "chords"))
+	{
+		// six-note chords on channels 1 and 2, a new one every 125 ms
+		static const uint8_t shape[6] = {0, 4, 7, 12, 16, 19};
+		for (uint32_t i = 0; i < 64; i++)
+		{
+			uint32_t t = i * 125000;
+			uint8_t ch = i & 1;
+			uint8_t root = 36 + (i * 5) % 24;
+			for (uint8_t n : shape)
+				printf("%u 9%X %02X 64\n", (unsigned) t, ch, root + n);
+			for (uint8_t n : shape)
+				printf("%u 8%X %02X 00\n", (unsigned) (t + 100000), ch, root + n);
+		}
+	}
+	else if (!strcmp(name, "pbsweep"))
+	{
+		// a held note bent all the way down and up, a bend every 2 ms
+		printf("0 90 3C 64\n");
+		uint32_t t = 10000;
+		for (int32_t bend = -8192; bend < 8192; bend += 64, t += 2000)
+			printf("%u E0 %02X %02X\n", (unsigned) t, (bend + 8192) & 0x7F, (bend + 8192) >> 7);
+		for (int32_t bend = 8191; bend >= -8192; bend -= 64, t += 2000)
+			printf("%u E0 %02X %02X\n", (unsigned) t, (bend + 8192) & 0x7F, (bend + 8192) >> 7);
+		printf("%u 80 3C 00\n", (unsigned) t);
+	}
+	else if (!strcmp(name, "clock300"))
+	{
+		// 24 PPQN at 300 BPM for 8 bars, with a note on every beat
+		const uint32_t period = 60000000UL / (300 * 24);
+		printf("0 FA\n");
+		for (uint32_t i = 0; i < 8 * 4 * 24; i++)
+		{
+			printf("%u F8\n", (unsigned) (i * period));
+			if (i % 24 == 0)
+				printf("%u 90 %02X 64\n%u 80 %02X 00\n", (unsigned) (i * period), 48 + (i / 24) % 12,
+					   (unsigned) (i * period + period * 12), 48 + (i / 24) % 12);
+		}
+		printf("%u FC\n", (unsigned) (8 * 4 * 24 * period));
+	}
+	else if (!strcmp(name, "kcsjumps"))
+	{
+		// KCS channel NoteOns jumping 1, 2, ... 8 steps on from where the DFAM is
+		static const uint8_t step_notes[DFAM_STEPS] = {48, 50, 52, 53, 55, 57, 59, 60};
+		uint8_t step = 1; // where the mode switch leaves it
+		for (uint8_t distance = 1; distance <= DFAM_STEPS; distance++)
+		{
+			uint32_t t = 100000 + distance * 50000;
+			step = (step - 1 + distance) % DFAM_STEPS + 1;
+			printf("%u 99 %02X 64\n%u 89 %02X 00\n", (unsigned) t, step_notes[step - 1],
+				   (unsigned) (t + 20000), step_notes[step - 1]);
+		}
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+/*
+	benchmark - ADV pulses sent for every NoteOn on the KCS channel (without
+		running status), timed from the NoteOn's last byte
+*/
+static void benchmark(const std::vector<TimedByte>& bytes)
+{
+	uint8_t note_on = 0x90 | (mctl.settings.midi_ch_KCS - 1);
+	std::vector<uint32_t> notes;
+	for (size_t i = 0; i + 2 < bytes.size(); i++)
+		if (bytes[i].data == note_on && bytes[i + 2].data)
+			notes.push_back(bytes[i + 2].us);
+
+	std::vector<uint32_t> rises;
+	for (const std::string& line : trace)
+	{
+		unsigned us, level;
+		if (sscanf(line.c_str(), "%u ADV %u", &us, &level) == 2 && level)
+			rises.push_back(us);
+	}
+
+	printf("%10s %7s %9s %9s\n", "note us", "pulses", "first us", "last us");
+	for (size_t n = 0; n < notes.size(); n++)
+	{
+		uint32_t end = n + 1 < notes.size() ? notes[n + 1] : UINT32_MAX;
+		std::vector<uint32_t> mine;
+		for (uint32_t us : rises)
+			if (us >= notes[n] && us < end)
+				mine.push_back(us - notes[n]);
+
+		if (mine.empty())
+			printf("%10u %7u %9s %9s\n", (unsigned) notes[n], 0u, "-", "-");
+		else
+			printf("%10u %7zu %9u %9u\n", (unsigned) notes[n], mine.size(), (unsigned) mine.front(), (unsigned) mine.back());
+	}
+}
+
+
+/************************************************************************/
+/*		MAIN                                                            */
+/************************************************************************/
+static int compare(const char* golden_path)
+{
+	std::ifstream in(golden_path);
+	if (!in)
+	{
+		fprintf(stderr, "can't read %s\n", golden_path);
+		return 2;
+	}
+
+	std::vector<std::string> golden;
+	std::string line;
+	while (std::getline(in, line))
+		if (!line.empty())
+			golden.push_back(line);
+
+	size_t n = std::min(golden.size(), trace.size());
+	for (size_t i = 0; i < n; i++)
+	{
+		if (golden[i] != trace[i])
+		{
+			fprintf(stderr, "line %zu differs\n  golden: %s\n  replay: %s\n", i + 1, golden[i].c_str(), trace[i].c_str());
+			return 1;
+		}
+	}
+
+	if (golden.size() != trace.size())
+	{
+		fprintf(stderr, "golden has %zu lines, replay has %zu\n", golden.size(), trace.size());
+		return 1;
+	}
+
+	fprintf(stderr, "%zu lines match\n", n);
+	return 0;
+}
+
+static int usage()
+{
+	fprintf(stderr, "usage: replay [-o trace] [-g golden] [-t tail ms] [-k] [-b] <capture>\n"
+					"       replay --gen chords|pbsweep|clock300|kcsjumps\n");
+	return 2;
+}
+
+int main(int argc, char** argv)
+{
+	const char* out_path = nullptr;
+	const char* golden_path = nullptr;
+	const char* capture_path = nullptr;
+	uint32_t tail_ms = 1000;
+	bool kcs = false;
+	bool bench = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--gen") && i + 1 < argc)
+			return generate(argv[i + 1]) ? 0 : usage();
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+			out_path = argv[++i];
+		else if (!strcmp(argv[i], "-g") && i + 1 < argc)
+			golden_path = argv[++i];
+		else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+			tail_ms = strtoul(argv[++i], nullptr, 10);
+		else if (!strcmp(argv[i], "-k"))
+			kcs = true;
+		else if (!strcmp(argv[i], "-b"))
+			bench = true;
+		else if (argv[i][0] != '-' && !capture_path)
+			capture_path = argv[i];
+		else
+			return usage();
+	}
+
+	if (!capture_path)
+		return usage();
+
+	std::vector<TimedByte> bytes;
+	if (!load_capture(capture_path, bytes))
+	{
+		fprintf(stderr, "can't read %s\n", capture_path);
+		return 2;
+	}
+
+	simulate(bytes, tail_ms * 1000, kcs);
+
+	if (bench)
+	{
+		benchmark(bytes);
+		return 0;
+	}
+
+	if (golden_path)
+		return compare(golden_path);
+
+	FILE* out = out_path ? fopen(out_path, "w") : stdout;
+	if (!out)
+	{
+		fprintf(stderr, "can't write %s\n", out_path);
+		return 2;
+	}
+	for (const std::string& line : trace)
+		fprintf(out, "%s\n", line.c_str());
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}